@@ -0,0 +1,97 @@
+#include "bricked_volume.h"
+
+#include <stdexcept>
+
+template <typename T>
+BrickedVolume<T>::BrickedVolume(const BasicVolumicData<T> &volume)
+    : width(volume.width), height(volume.height), depth(volume.depth),
+      nb_bricks_x((volume.width + brick_size - 1) / brick_size),
+      nb_bricks_y((volume.height + brick_size - 1) / brick_size),
+      nb_bricks_z((volume.depth + brick_size - 1) / brick_size),
+      bricks((size_t)nb_bricks_x * nb_bricks_y * nb_bricks_z * brick_voxels,
+             T(0)) {
+  // Reading the source line by line keeps the linear accesses sequential
+  for (int z = 0; z < depth; z++) {
+    for (int y = 0; y < height; y++) {
+      const T *line = volume.getLayerData(z) + (size_t)width * y;
+      for (int x = 0; x < width; x++) {
+        size_t brick_idx =
+            getBrickIndex(x / brick_size, y / brick_size, z / brick_size);
+        bricks[brick_idx * brick_voxels +
+               getMortonOffset(x % brick_size, y % brick_size,
+                               z % brick_size)] = line[x];
+      }
+    }
+  }
+}
+
+template <typename T>
+void BrickedVolume<T>::toLinear(BasicVolumicData<T> *volume) const {
+  if (volume->width != width || volume->height != height ||
+      volume->depth != depth)
+    throw std::invalid_argument("BrickedVolume::toLinear: size mismatch");
+  for (int z = 0; z < depth; z++) {
+    T *layer = volume->getLayerData(z);
+    for (int y = 0; y < height; y++) {
+      T *line = layer + (size_t)width * y;
+      for (int x = 0; x < width; x++)
+        line[x] = get(x, y, z);
+    }
+    volume->updateLayerSummary(z);
+  }
+}
+
+template <typename T>
+void BrickedVolume<T>::getNeighbourhood(int x, int y, int z, T values[27],
+                                        bool inside[27]) const {
+  // Brick and local coordinates of the 3 positions along each axis, so that
+  // the divisions are only computed once
+  int brick[3][3], local[3][3];
+  bool valid[3][3];
+  const int center[3] = {x, y, z};
+  const int size[3] = {width, height, depth};
+  for (int axis = 0; axis < 3; axis++) {
+    for (int d = 0; d < 3; d++) {
+      int pos = center[axis] + d - 1;
+      valid[axis][d] = pos >= 0 && pos < size[axis];
+      brick[axis][d] = valid[axis][d] ? pos / brick_size : 0;
+      local[axis][d] = valid[axis][d] ? pos % brick_size : 0;
+    }
+  }
+  for (int dz = 0; dz < 3; dz++) {
+    for (int dy = 0; dy < 3; dy++) {
+      for (int dx = 0; dx < 3; dx++) {
+        int idx = dx + 3 * dy + 9 * dz;
+        inside[idx] = valid[0][dx] && valid[1][dy] && valid[2][dz];
+        if (!inside[idx])
+          continue;
+        size_t brick_idx =
+            getBrickIndex(brick[0][dx], brick[1][dy], brick[2][dz]);
+        values[idx] =
+            bricks[brick_idx * brick_voxels +
+                   getMortonOffset(local[0][dx], local[1][dy], local[2][dz])];
+      }
+    }
+  }
+}
+
+template <typename T> size_t BrickedVolume<T>::getNbBricks() const {
+  return (size_t)nb_bricks_x * nb_bricks_y * nb_bricks_z;
+}
+
+template <typename T>
+const T *BrickedVolume<T>::getBrick(size_t brick_idx) const {
+  return bricks.data() + brick_idx * brick_voxels;
+}
+
+template <typename T>
+void BrickedVolume<T>::getBrickOrigin(size_t brick_idx, int *x, int *y,
+                                      int *z) const {
+  *x = (brick_idx % nb_bricks_x) * brick_size;
+  *y = (brick_idx / nb_bricks_x % nb_bricks_y) * brick_size;
+  *z = (brick_idx / ((size_t)nb_bricks_x * nb_bricks_y)) * brick_size;
+}
+
+template class BrickedVolume<int16_t>;
+template class BrickedVolume<uint8_t>;
+template class BrickedVolume<float>;
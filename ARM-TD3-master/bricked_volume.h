@@ -0,0 +1,77 @@
+#ifndef BRICKED_VOLUME_H
+#define BRICKED_VOLUME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "volumic_data.h"
+
+/// A copy of a volume stored as bricks of 8*8*8 voxels
+///
+/// Bricks are stored x-fastest, while the voxels inside a brick follow the
+/// Morton (Z-order) curve. A 3*3*3 neighbourhood then spans at most 8
+/// bricks instead of 9 lines spread over 3 slices, which keeps stencil
+/// kernels such as contour detection on cache-resident data.
+template <typename T> class BrickedVolume {
+public:
+  /// Number of voxels along each side of a brick
+  static const int brick_size = 8;
+  /// Number of voxels in a brick
+  static const int brick_voxels = brick_size * brick_size * brick_size;
+
+  int width;
+  int height;
+  int depth;
+
+  /// Copy the voxels of 'volume', its layers should all be ready
+  explicit BrickedVolume(const BasicVolumicData<T> &volume);
+
+  /// Copy the voxels back to 'volume', which must have the same dimensions
+  void toLinear(BasicVolumicData<T> *volume) const;
+
+  inline T get(int x, int y, int z) const {
+    return bricks[getBrickIndex(x / brick_size, y / brick_size,
+                                z / brick_size) *
+                      brick_voxels +
+                  getMortonOffset(x % brick_size, y % brick_size,
+                                  z % brick_size)];
+  }
+
+  /// Copy the 3*3*3 neighbourhood of (x,y,z) to 'values', the neighbour at
+  /// (x+dx,y+dy,z+dz) is at index (dx+1) + 3*(dy+1) + 9*(dz+1). 'inside'
+  /// tells which neighbours are inside of the volume, the others are left
+  /// untouched.
+  void getNeighbourhood(int x, int y, int z, T values[27],
+                        bool inside[27]) const;
+
+  /// Brick iteration
+  size_t getNbBricks() const;
+  /// The brick_voxels voxels of brick 'brick_idx' in Morton order
+  const T *getBrick(size_t brick_idx) const;
+  /// Coordinates of the first voxel of brick 'brick_idx'
+  void getBrickOrigin(size_t brick_idx, int *x, int *y, int *z) const;
+
+  /// Position of the voxel (x,y,z) inside its brick, all coordinates being
+  /// in [0, brick_size[
+  static inline int getMortonOffset(int x, int y, int z) {
+    // Spreads the 3 bits of a coordinate: abc -> a00b00c
+    static const uint16_t spread[brick_size] = {0, 1, 8, 9, 64, 65, 72, 73};
+    return spread[x] | (spread[y] << 1) | (spread[z] << 2);
+  }
+
+private:
+  /// Number of bricks along each axis
+  int nb_bricks_x;
+  int nb_bricks_y;
+  int nb_bricks_z;
+
+  /// Voxels outside of the volume in the border bricks are set to 0
+  std::vector<T> bricks;
+
+  inline size_t getBrickIndex(int bx, int by, int bz) const {
+    return bx + (size_t)nb_bricks_x * (by + (size_t)nb_bricks_y * bz);
+  }
+};
+
+#endif // BRICKED_VOLUME_H
@@ -0,0 +1,286 @@
+#include "compressed_volume.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "parallel.h"
+
+namespace {
+/// Tokens of the compressed stream, the previous voxel being the prediction
+/// - [0x00, 0x7f]: one voxel, the zigzag coded delta being the token
+/// - [0x80, 0xbf]: (token & 0x3f) + 2 voxels equal to the previous one
+/// - raw_token + 2 bytes: one voxel stored as is (little endian)
+/// - long_run_token + 2 bytes: a run of up to 65535 voxels equal to the
+///   previous one
+const uint8_t max_delta_token = 0x7f;
+const uint8_t short_run_token = 0x80;
+const int max_short_run = 0x3f + 2;
+const uint8_t raw_token = 0xc0;
+const uint8_t long_run_token = 0xc1;
+
+void write16(uint16_t value, std::vector<uint8_t> *out) {
+  out->push_back(value & 0xff);
+  out->push_back(value >> 8);
+}
+
+uint16_t read16(const uint8_t *data) { return data[0] | (data[1] << 8); }
+} // namespace
+
+CompressedVolume::CompressedVolume(const VolumicData &volume,
+                                   size_t cache_size, int nb_threads)
+    : width(volume.width), height(volume.height), depth(volume.depth),
+      pixel_width(volume.pixel_width), pixel_height(volume.pixel_height),
+      slice_spacing(volume.slice_spacing), win_min(volume.win_min),
+      win_max(volume.win_max),
+      nb_bricks_x((volume.width + brick_size - 1) / brick_size),
+      nb_bricks_y((volume.height + brick_size - 1) / brick_size),
+      nb_bricks_z((volume.depth + brick_size - 1) / brick_size),
+      bricks((size_t)nb_bricks_x * nb_bricks_y * nb_bricks_z) {
+  const size_t brick_voxels = (size_t)brick_size * brick_size * brick_size;
+  max_cached_bricks = std::max<size_t>(
+      1, cache_size / (brick_voxels * sizeof(VolumicData::Voxel)));
+  parallelFor(
+      0, bricks.size(),
+      [&](size_t brick_idx) {
+        int brick_x = brick_idx % nb_bricks_x;
+        int brick_y = brick_idx / nb_bricks_x % nb_bricks_y;
+        int brick_z = brick_idx / ((size_t)nb_bricks_x * nb_bricks_y);
+        // Voxels outside of the volume replicate the border, so that they
+        // are encoded as runs
+        std::vector<VolumicData::Voxel> voxels(brick_voxels);
+        size_t voxel_idx = 0;
+        for (int z = 0; z < brick_size; z++) {
+          int layer = std::min(brick_z * brick_size + z, depth - 1);
+          for (int y = 0; y < brick_size; y++) {
+            int row = std::min(brick_y * brick_size + y, height - 1);
+            for (int x = 0; x < brick_size; x++) {
+              int col = std::min(brick_x * brick_size + x, width - 1);
+              voxels[voxel_idx++] = volume.getValue(col, row, layer);
+            }
+          }
+        }
+        encodeBrick(voxels.data(), brick_voxels, &bricks[brick_idx]);
+        bricks[brick_idx].shrink_to_fit();
+      },
+      nb_threads);
+}
+
+VolumicData::Voxel CompressedVolume::getValue(int col, int row,
+                                              int layer) const {
+  BrickPtr brick = getBrick(getBrickIndex(
+      col / brick_size, row / brick_size, layer / brick_size));
+  return (*brick)[col % brick_size +
+                  brick_size * (row % brick_size +
+                                brick_size * (layer % brick_size))];
+}
+
+void CompressedVolume::readLayer(int layer, VolumicData::Voxel *voxels) const {
+  const int z = layer % brick_size;
+  for (int brick_y = 0; brick_y < nb_bricks_y; brick_y++) {
+    for (int brick_x = 0; brick_x < nb_bricks_x; brick_x++) {
+      BrickPtr brick =
+          getBrick(getBrickIndex(brick_x, brick_y, layer / brick_size));
+      int x_begin = brick_x * brick_size;
+      int nb_cols = std::min(brick_size, width - x_begin);
+      for (int y = 0; y < brick_size && brick_y * brick_size + y < height;
+           y++) {
+        const VolumicData::Voxel *line =
+            brick->data() + brick_size * (y + brick_size * z);
+        std::copy(line, line + nb_cols,
+                  voxels + x_begin +
+                      (size_t)width * (brick_y * brick_size + y));
+      }
+    }
+  }
+}
+
+std::unique_ptr<VolumicData> CompressedVolume::readSlab(int first_layer,
+                                                        int nb_layers) const {
+  int begin = std::max(first_layer, 0);
+  int end = std::min(first_layer + nb_layers, depth);
+  std::unique_ptr<VolumicData> slab(new VolumicData(
+      width, height, std::max(end - begin, 0), win_min, win_max));
+  slab->pixel_width = pixel_width;
+  slab->pixel_height = pixel_height;
+  slab->slice_spacing = slice_spacing;
+  if (end <= begin)
+    return slab;
+  // The bricks are decoded directly, the cache is kept for random accesses
+  std::vector<VolumicData::Voxel> brick(brick_size * brick_size * brick_size);
+  for (int brick_z = begin / brick_size; brick_z <= (end - 1) / brick_size;
+       brick_z++) {
+    for (int brick_y = 0; brick_y < nb_bricks_y; brick_y++) {
+      for (int brick_x = 0; brick_x < nb_bricks_x; brick_x++) {
+        decodeBrick(bricks[getBrickIndex(brick_x, brick_y, brick_z)],
+                    brick.data(), brick.size());
+        copyBrick(brick.data(), brick_x, brick_y, brick_z, begin, slab.get());
+      }
+    }
+  }
+  for (int layer = 0; layer < slab->depth; layer++) {
+    slab->updateLayerSummary(layer);
+    slab->setLayerReady(layer);
+  }
+  return slab;
+}
+
+std::unique_ptr<VolumicData> CompressedVolume::decompress(int nb_threads) const {
+  std::unique_ptr<VolumicData> volume(
+      new VolumicData(width, height, depth, win_min, win_max));
+  volume->pixel_width = pixel_width;
+  volume->pixel_height = pixel_height;
+  volume->slice_spacing = slice_spacing;
+  VolumicData *dst = volume.get();
+  // Each slab of bricks fills its own layers
+  parallelFor(
+      0, nb_bricks_z,
+      [this, dst](size_t brick_z) {
+        std::vector<VolumicData::Voxel> brick(brick_size * brick_size *
+                                              brick_size);
+        for (int brick_y = 0; brick_y < nb_bricks_y; brick_y++) {
+          for (int brick_x = 0; brick_x < nb_bricks_x; brick_x++) {
+            decodeBrick(bricks[getBrickIndex(brick_x, brick_y, brick_z)],
+                        brick.data(), brick.size());
+            copyBrick(brick.data(), brick_x, brick_y, brick_z, 0, dst);
+          }
+        }
+        int layer_end = std::min((int)(brick_z + 1) * brick_size, depth);
+        for (int layer = brick_z * brick_size; layer < layer_end; layer++) {
+          dst->updateLayerSummary(layer);
+          dst->setLayerReady(layer);
+        }
+      },
+      nb_threads);
+  return volume;
+}
+
+size_t CompressedVolume::getRawSize() const {
+  return (size_t)width * height * depth * sizeof(VolumicData::Voxel);
+}
+
+size_t CompressedVolume::getCompressedSize() const {
+  size_t size = 0;
+  for (const std::vector<uint8_t> &brick : bricks)
+    size += brick.size();
+  return size;
+}
+
+void CompressedVolume::encodeBrick(const VolumicData::Voxel *voxels,
+                                   size_t nb_voxels,
+                                   std::vector<uint8_t> *out) {
+  int previous = 0;
+  size_t idx = 0;
+  while (idx < nb_voxels) {
+    size_t run = 0;
+    while (idx + run < nb_voxels && voxels[idx + run] == previous &&
+           run < 0xffff)
+      run++;
+    if (run >= 2) {
+      if (run <= (size_t)max_short_run) {
+        out->push_back(short_run_token | (run - 2));
+      } else {
+        out->push_back(long_run_token);
+        write16(run, out);
+      }
+      idx += run;
+      continue;
+    }
+    int value = voxels[idx];
+    int delta = value - previous;
+    unsigned int zigzag = delta >= 0 ? 2 * delta : -2 * delta - 1;
+    if (zigzag <= max_delta_token) {
+      out->push_back(zigzag);
+    } else {
+      out->push_back(raw_token);
+      write16((uint16_t)value, out);
+    }
+    previous = value;
+    idx++;
+  }
+}
+
+void CompressedVolume::decodeBrick(const std::vector<uint8_t> &data,
+                                   VolumicData::Voxel *voxels,
+                                   size_t nb_voxels) {
+  int previous = 0;
+  size_t idx = 0;
+  size_t pos = 0;
+  while (idx < nb_voxels) {
+    if (pos >= data.size())
+      throw std::runtime_error("Truncated compressed brick");
+    uint8_t token = data[pos++];
+    if (token >= raw_token && pos + 2 > data.size())
+      throw std::runtime_error("Truncated compressed brick");
+    size_t run = 1;
+    if (token <= max_delta_token) {
+      // Inverse of the zigzag coding
+      previous += (token & 1) ? -(int)((token + 1) / 2) : token / 2;
+    } else if (token < raw_token) {
+      run = (token & 0x3f) + 2;
+    } else if (token == raw_token) {
+      previous = (VolumicData::Voxel)read16(&data[pos]);
+      pos += 2;
+    } else {
+      run = read16(&data[pos]);
+      pos += 2;
+    }
+    if (idx + run > nb_voxels)
+      throw std::runtime_error("Invalid compressed brick");
+    std::fill(voxels + idx, voxels + idx + run,
+              (VolumicData::Voxel)previous);
+    idx += run;
+  }
+}
+
+size_t CompressedVolume::getBrickIndex(int brick_x, int brick_y,
+                                       int brick_z) const {
+  return brick_x +
+         (size_t)nb_bricks_x * (brick_y + (size_t)nb_bricks_y * brick_z);
+}
+
+CompressedVolume::BrickPtr CompressedVolume::getBrick(size_t brick_idx) const {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cached_bricks.find(brick_idx);
+    if (it != cached_bricks.end()) {
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->second;
+    }
+  }
+  // Decoded without holding the cache, other threads keep using it meanwhile
+  std::shared_ptr<std::vector<VolumicData::Voxel>> brick(
+      new std::vector<VolumicData::Voxel>(brick_size * brick_size *
+                                          brick_size));
+  decodeBrick(bricks[brick_idx], brick->data(), brick->size());
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  auto it = cached_bricks.find(brick_idx);
+  if (it != cached_bricks.end())
+    return it->second->second;
+  lru.emplace_front(brick_idx, brick);
+  cached_bricks[brick_idx] = lru.begin();
+  while (lru.size() > max_cached_bricks) {
+    cached_bricks.erase(lru.back().first);
+    lru.pop_back();
+  }
+  return brick;
+}
+
+void CompressedVolume::copyBrick(const VolumicData::Voxel *brick, int brick_x,
+                                 int brick_y, int brick_z, int first_layer,
+                                 VolumicData *slab) const {
+  int x_begin = brick_x * brick_size;
+  int nb_cols = std::min(brick_size, width - x_begin);
+  for (int z = 0; z < brick_size; z++) {
+    int layer = brick_z * brick_size + z - first_layer;
+    if (layer < 0 || layer >= slab->depth)
+      continue;
+    for (int y = 0; y < brick_size && brick_y * brick_size + y < height;
+         y++) {
+      const VolumicData::Voxel *line =
+          brick + brick_size * (y + brick_size * z);
+      std::copy(line, line + nb_cols,
+                slab->getLayerData(layer) + x_begin +
+                    (size_t)width * (brick_y * brick_size + y));
+    }
+  }
+}
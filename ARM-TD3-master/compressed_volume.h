@@ -0,0 +1,94 @@
+#ifndef COMPRESSED_VOLUME_H
+#define COMPRESSED_VOLUME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "volumic_data.h"
+
+/// A copy of a VolumicData whose bricks are compressed without loss
+///
+/// Each brick of brick_size^3 voxels is delta coded along its rows and the
+/// deltas are written as a byte stream where runs of identical voxels take a
+/// single byte and small deltas one byte each. Uniform regions such as air
+/// compress to a few bytes per brick, noisy tissues to about one byte per
+/// voxel.
+///
+/// Voxels are decompressed on access, the last decompressed bricks being
+/// kept in a small cache. All the methods can be called from several
+/// threads.
+class CompressedVolume {
+public:
+  /// Number of voxels along each side of a brick
+  static const int brick_size = 16;
+
+  int width;
+  int height;
+  int depth;
+  double pixel_width;
+  double pixel_height;
+  double slice_spacing;
+  /// The default window [HU]
+  double win_min;
+  double win_max;
+
+  /// Compress 'volume' on 'nb_threads' threads (one per core if <= 0), its
+  /// layers should all be ready
+  /// - At most 'cache_size' bytes of decompressed bricks are kept
+  CompressedVolume(const VolumicData &volume, size_t cache_size = 16 << 20,
+                   int nb_threads = 0);
+
+  VolumicData::Voxel getValue(int col, int row, int layer) const;
+  /// Copy the width*height voxels of 'layer' to 'voxels'
+  void readLayer(int layer, VolumicData::Voxel *voxels) const;
+  /// Decompress the layers [first_layer, first_layer + nb_layers), the range
+  /// being clipped to the volume. All the layers of the result are ready.
+  std::unique_ptr<VolumicData> readSlab(int first_layer, int nb_layers) const;
+  /// Decompress the whole volume on 'nb_threads' threads
+  std::unique_ptr<VolumicData> decompress(int nb_threads = 0) const;
+
+  /// Size of the voxels once decompressed [bytes]
+  size_t getRawSize() const;
+  /// Size of the compressed bricks [bytes]
+  size_t getCompressedSize() const;
+
+  /// Encode the 'nb_voxels' voxels of a brick, appending them to 'out'
+  static void encodeBrick(const VolumicData::Voxel *voxels, size_t nb_voxels,
+                          std::vector<uint8_t> *out);
+  /// Decode a brick of 'nb_voxels' voxels encoded by encodeBrick
+  static void decodeBrick(const std::vector<uint8_t> &data,
+                          VolumicData::Voxel *voxels, size_t nb_voxels);
+
+private:
+  typedef std::shared_ptr<const std::vector<VolumicData::Voxel>> BrickPtr;
+
+  int nb_bricks_x;
+  int nb_bricks_y;
+  int nb_bricks_z;
+  std::vector<std::vector<uint8_t>> bricks;
+
+  /// Maximal number of decompressed bricks in the cache
+  size_t max_cached_bricks;
+  /// Protects the cache
+  mutable std::mutex cache_mutex;
+  /// Decompressed bricks by order of use, the most recent first
+  mutable std::list<std::pair<size_t, BrickPtr>> lru;
+  mutable std::map<size_t,
+                   std::list<std::pair<size_t, BrickPtr>>::iterator>
+      cached_bricks;
+
+  size_t getBrickIndex(int brick_x, int brick_y, int brick_z) const;
+  /// Retrieve the decompressed brick 'brick_idx' through the cache
+  BrickPtr getBrick(size_t brick_idx) const;
+  /// Copy the voxels of 'brick' which are in the layers
+  /// [first_layer, first_layer + slab.depth) to 'slab'
+  void copyBrick(const VolumicData::Voxel *brick, int brick_x, int brick_y,
+                 int brick_z, int first_layer, VolumicData *slab) const;
+};
+
+#endif // COMPRESSED_VOLUME_H
@@ -0,0 +1,499 @@
+// Headless conversion of a Dicom series to a point cloud
+//
+// It runs the same loading and extraction code as dicom_viewer without any
+// widget, so that it can be used on machines without display.
+
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+
+#include <dcmtk/dcmdata/dcrledrg.h>
+#include <dcmtk/dcmjpeg/djdecode.h>
+#include <dcmtk/dcmjpls/djdecode.h>
+
+#include "compressed_volume.h"
+#include "dicom_collection.h"
+#include "out_of_core_volume.h"
+#include "point_extractor.h"
+#include "rescale_kernel.h"
+#include "series_index.h"
+#include "volume_cache.h"
+
+namespace {
+/// The parameters of a conversion, read from the command line
+struct BatchOptions {
+  std::string input_dir;
+  std::string output_path;
+  /// Empty to use the only series of the directory
+  std::string series_uid;
+  int nb_threads;
+  bool use_cache;
+  /// Intensity window, the default window of the series is used if not set
+  bool has_window;
+  double window_center;
+  double window_width;
+  /// Use a window computed from the histogram of the volume
+  bool auto_window;
+  /// Range of extracted values, the intensity window is used if not set
+  bool has_threshold;
+  double threshold_min;
+  double threshold_max;
+  bool contours_mode;
+  bool color_mode;
+  /// Maximal size of the bricks kept in memory [bytes], the volume is
+  /// converted out of core if > 0
+  size_t memory_cap;
+  /// Keep the volume compressed in memory during the extraction
+  bool compress;
+  /// Time the extraction kernels instead of writing the points
+  bool benchmark_kernels;
+};
+
+/// Prints the time spent in each stage of the conversion
+class StageTimer {
+public:
+  StageTimer() { timer.start(); }
+
+  /// Report the time elapsed since the end of the previous stage
+  void endStage(const std::string &name) {
+    qint64 now = timer.elapsed();
+    std::cout << "[timing] " << name << ": " << (now - last_stage_end)
+              << " ms" << std::endl;
+    last_stage_end = now;
+  }
+
+  qint64 getTotal() const { return timer.elapsed(); }
+
+private:
+  QElapsedTimer timer;
+  qint64 last_stage_end = 0;
+};
+
+/// Removes a temporary file when leaving its scope, including on errors
+class TemporaryFile {
+public:
+  explicit TemporaryFile(const std::string &path) : path(path) {}
+  ~TemporaryFile() { QFile::remove(QString::fromStdString(path)); }
+
+private:
+  std::string path;
+};
+
+/// Parse 'name' as a double, print an error and return false on failure
+bool parseDouble(const QCommandLineParser &parser,
+                 const QCommandLineOption &option, const std::string &name,
+                 double *value) {
+  bool ok = false;
+  *value = parser.value(option).toDouble(&ok);
+  if (!ok)
+    std::cerr << "Invalid value for --" << name << ": "
+              << parser.value(option).toStdString() << std::endl;
+  return ok;
+}
+
+/// Select the series to convert among the ones of 'index'
+/// Throws a DicomCollectionError if there is no suitable series
+const DicomSeries &selectSeries(const SeriesIndex &index,
+                                const std::string &series_uid) {
+  if (series_uid != "") {
+    auto it = index.series.find(series_uid);
+    if (it == index.series.end())
+      throw DicomCollectionError("Unknown series",
+                                 "No series with UID " + series_uid);
+    return it->second;
+  }
+  if (index.series.size() == 0)
+    throw DicomCollectionError("No series found", "No Dicom series found");
+  if (index.series.size() > 1) {
+    std::string msg = "Several series found, choose one with --series:";
+    for (const auto &entry : index.series)
+      msg += "\n  " + entry.first + " (" +
+             std::to_string(entry.second.slices.size()) + " slices)";
+    throw DicomCollectionError("Ambiguous directory", msg);
+  }
+  return index.series.begin()->second;
+}
+
+/// Window of the extracted volume, from the options or from the histogram
+/// of the volume if requested. The window is left unchanged otherwise.
+void applyWindow(const BatchOptions &options, const Histogram &histogram,
+                 double *win_min, double *win_max) {
+  if (options.auto_window) {
+    double center, width;
+    histogram.getAutoWindow(&center, &width);
+    *win_min = center - width / 2;
+    *win_max = center + width / 2;
+  } else if (options.has_window) {
+    *win_min = options.window_center - options.window_width / 2;
+    *win_max = options.window_center + options.window_width / 2;
+  }
+}
+
+PointExtractor createExtractor(const BatchOptions &options, double win_min,
+                               double win_max) {
+  PointExtractor extractor;
+  extractor.threshold_min =
+      options.has_threshold ? options.threshold_min : win_min;
+  extractor.threshold_max =
+      options.has_threshold ? options.threshold_max : win_max;
+  extractor.contours_mode = options.contours_mode;
+  extractor.color_mode = options.color_mode;
+  return extractor;
+}
+
+typedef std::function<void(const DrawablePoint &)> PointCallback;
+
+/// Write the points produced by 'extract' to the output file
+/// Points are written as soon as they are extracted, the cloud is never
+/// stored in memory
+void writePoints(const BatchOptions &options,
+                 const std::function<size_t(const PointCallback &)> &extract,
+                 StageTimer *timer) {
+  std::ofstream out(options.output_path);
+  if (!out)
+    throw DicomCollectionError("Failed to write output", options.output_path);
+  size_t nb_points = extract([&out](const DrawablePoint &p) {
+    out << p.pos.x() << " " << p.pos.y() << " " << p.pos.z() << "\n";
+  });
+  out.close();
+  if (!out)
+    throw DicomCollectionError("Failed to write output", options.output_path);
+  std::cout << "Wrote " << nb_points << " points to " << options.output_path
+            << std::endl;
+  timer->endStage("extract and write");
+}
+
+/// Compress 'volume', report the compression ratio and the decompression
+/// throughput, then extract the points from the compressed copy
+void runCompressed(const BatchOptions &options,
+                   std::unique_ptr<VolumicData> volume,
+                   const PointExtractor &extractor, StageTimer *timer) {
+  CompressedVolume compressed(*volume, 16 << 20, options.nb_threads);
+  volume.reset();
+  timer->endStage("compress");
+  double raw_mb = compressed.getRawSize() / (1024.0 * 1024.0);
+  double compressed_mb = compressed.getCompressedSize() / (1024.0 * 1024.0);
+  std::cout << "Compressed " << raw_mb << " MB to " << compressed_mb
+            << " MB (ratio " << raw_mb / std::max(compressed_mb, 1e-9) << ")"
+            << std::endl;
+
+  QElapsedTimer decode_timer;
+  decode_timer.start();
+  for (int first_layer = 0; first_layer < compressed.depth;
+       first_layer += CompressedVolume::brick_size)
+    compressed.readSlab(first_layer, CompressedVolume::brick_size);
+  double seconds = std::max<qint64>(decode_timer.elapsed(), 1) / 1000.0;
+  std::cout << "Decompressed at " << raw_mb / seconds << " MB/s" << std::endl;
+  timer->endStage("decompress");
+
+  writePoints(options,
+              [&](const PointCallback &on_point) {
+                return extractor.extract(compressed, on_point);
+              },
+              timer);
+}
+
+/// Time the extraction of 'volume' with the generic kernel and with each
+/// specialised kernel the viewer uses: every contours neighbourhood, color
+/// mode, highlight and empty points setting. The points are gathered in
+/// buffers on a single thread, as the viewer does on each of its threads.
+/// The other settings are the ones of 'settings'.
+void benchmarkKernels(const VolumicData &volume,
+                      const PointExtractor &settings) {
+  const int nb_runs = 3;
+  // The generic kernel reads the neighbourhoods from a bricked copy
+  BrickedVolume<VolumicData::Voxel> bricked(volume);
+  for (int neighbourhood : {0, 6, 18, 26}) {
+    for (int flags = 0; flags < 8; flags++) {
+      PointExtractor extractor = settings;
+      extractor.contours_mode = neighbourhood != 0;
+      extractor.contours_neighbourhood = neighbourhood;
+      extractor.color_mode = flags & 1;
+      extractor.highlight = flags & 2;
+      extractor.hide_empty_points = flags & 4;
+      extractor.active_slice = volume.depth / 2 + 1;
+      // Best time of each kernel [ms]
+      double best[2];
+      size_t nb_points = 0;
+      for (int specialised = 0; specialised < 2; specialised++) {
+        extractor.specialised_kernels = specialised != 0;
+        best[specialised] = -1;
+        for (int run = 0; run < nb_runs; run++) {
+          QElapsedTimer timer;
+          timer.start();
+          nb_points = extractor.extractPoints(volume, &bricked, 1).size();
+          double ms = timer.nsecsElapsed() / 1e6;
+          if (best[specialised] < 0 || ms < best[specialised])
+            best[specialised] = ms;
+        }
+      }
+      std::cout << "[kernel] contours " << neighbourhood << ", color "
+                << (extractor.color_mode ? "on" : "off") << ", highlight "
+                << (extractor.highlight ? "on" : "off") << ", hide empty "
+                << (extractor.hide_empty_points ? "on" : "off") << ": "
+                << nb_points << " points, generic " << best[0]
+                << " ms, specialised " << best[1] << " ms (x"
+                << best[0] / std::max(best[1], 1e-6) << ")" << std::endl;
+    }
+  }
+}
+
+/// Decode the whole volume in memory, or map it from the cache, and extract
+/// its points
+void runInMemory(const BatchOptions &options, const DicomSeries &series,
+                 DicomCollection *collection, StageTimer *timer) {
+  VolumeCacheInfo cache_info;
+  std::unique_ptr<VolumicData> volume;
+  if (options.use_cache)
+    volume = openVolumeCache(series.cache_path, series.signature, &cache_info);
+  if (volume) {
+    timer->endStage("map cache");
+  } else {
+    volume = collection->createVolume();
+    collection->decode(options.nb_threads, volume.get());
+    timer->endStage("decode");
+    if (options.use_cache) {
+      cache_info.signature = series.signature;
+      cache_info.min_value = collection->min_value;
+      cache_info.max_value = collection->max_value;
+      QDir().mkpath(
+          QFileInfo(QString::fromStdString(series.cache_path)).absolutePath());
+      saveVolumeCache(*volume, cache_info, series.cache_path);
+      timer->endStage("write cache");
+    }
+  }
+
+  applyWindow(options, volume->getVolumeHistogram(), &volume->win_min,
+              &volume->win_max);
+  PointExtractor extractor =
+      createExtractor(options, volume->win_min, volume->win_max);
+  if (options.benchmark_kernels) {
+    benchmarkKernels(*volume, extractor);
+    timer->endStage("benchmark kernels");
+    return;
+  }
+  if (options.compress) {
+    runCompressed(options, std::move(volume), extractor, timer);
+    return;
+  }
+  writePoints(options,
+              [&](const PointCallback &on_point) {
+                return extractor.extract(*volume, on_point);
+              },
+              timer);
+}
+
+/// Decode the volume slab by slab to a brick file next to the output, then
+/// extract its points through a cache bounded by options.memory_cap
+/// The brick file is removed once the points are written or on failure
+void runOutOfCore(const BatchOptions &options, DicomCollection *collection,
+                  StageTimer *timer) {
+  const int brick_size = 32;
+  std::string bricks_path = options.output_path + ".bricks";
+  std::unique_ptr<VolumicData> slab = collection->createSlab(brick_size);
+  BrickFileInfo info;
+  info.width = slab->width;
+  info.height = slab->height;
+  info.depth = collection->getMaxInstance() - collection->getMinInstance() + 1;
+  info.brick_size = brick_size;
+  info.pixel_width = slab->pixel_width;
+  info.pixel_height = slab->pixel_height;
+  info.slice_spacing = slab->slice_spacing;
+  info.win_min = slab->win_min;
+  info.win_max = slab->win_max;
+  // Checked before decoding, the brick file could not be read anyway
+  size_t min_cap = OutOfCoreVolume<VolumicData::Voxel>::getMinMemoryCap(info);
+  if (options.memory_cap < min_cap)
+    throw DicomCollectionError(
+        "Memory cap too low",
+        "At least " + std::to_string(min_cap / (1024 * 1024) + 1) +
+            " MB are needed to read the volume out of core");
+  // Declared before the writer and the volume, so that they release the
+  // file first
+  TemporaryFile bricks_file(bricks_path);
+  std::unique_ptr<BrickFileWriter<VolumicData::Voxel>> writer =
+      BrickFileWriter<VolumicData::Voxel>::create(bricks_path, info);
+  if (!writer)
+    throw DicomCollectionError("Failed to write brick file", bricks_path);
+  // The histogram of the volume is reduced from the ones of the slabs
+  Histogram histogram;
+  for (int first_layer = 0; first_layer < info.depth;
+       first_layer += brick_size) {
+    slab = collection->createSlab(
+        std::min(brick_size, info.depth - first_layer));
+    collection->decodeSlab(first_layer, slab.get(), options.nb_threads);
+    histogram.merge(slab->getVolumeHistogram());
+    if (!writer->writeSlab(*slab, first_layer))
+      throw DicomCollectionError("Failed to write brick file", bricks_path);
+  }
+  slab.reset();
+  if (!writer->close())
+    throw DicomCollectionError("Failed to write brick file", bricks_path);
+  timer->endStage("decode to bricks");
+
+  std::unique_ptr<OutOfCoreVolume<VolumicData::Voxel>> volume =
+      OutOfCoreVolume<VolumicData::Voxel>::open(bricks_path,
+                                                options.memory_cap);
+  if (!volume)
+    throw DicomCollectionError("Failed to open brick file", bricks_path);
+  double win_min = info.win_min;
+  double win_max = info.win_max;
+  applyWindow(options, histogram, &win_min, &win_max);
+  volume->setWindow(win_min, win_max);
+  PointExtractor extractor = createExtractor(options, win_min, win_max);
+  writePoints(options,
+              [&](const PointCallback &on_point) {
+                return extractor.extract(*volume, on_point);
+              },
+              timer);
+  std::cout << "Loaded " << volume->getNbBrickLoads() << " bricks"
+            << std::endl;
+}
+
+/// Run the conversion described by 'options'
+/// Throws a DicomCollectionError if the series can not be loaded
+void run(const BatchOptions &options) {
+  StageTimer timer;
+
+  SeriesIndex index(options.input_dir);
+  index.update(options.nb_threads);
+  std::cout << "Indexed " << options.input_dir << ": " << index.nb_parsed_files
+            << " files parsed, " << index.nb_cached_files << " files reused"
+            << std::endl;
+  timer.endStage("index");
+
+  const DicomSeries &series = selectSeries(index, options.series_uid);
+  DicomCollection collection;
+  collection.validate(series.slices);
+  std::cout << "Series " << series.series_uid << ": "
+            << collection.slices.size() << " slices, " << getRescaleKernelName()
+            << " rescale" << std::endl;
+  timer.endStage("validate");
+
+  if (options.memory_cap > 0)
+    runOutOfCore(options, &collection, &timer);
+  else
+    runInMemory(options, series, &collection, &timer);
+  std::cout << "[timing] total: " << timer.getTotal() << " ms" << std::endl;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("dicom_batch");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Convert a Dicom series to a point cloud in XYZ format");
+  parser.addHelpOption();
+  parser.addPositionalArgument("directory",
+                               "Directory tree containing the series");
+  QCommandLineOption output_option({"o", "output"}, "Output XYZ file.",
+                                   "file", "points.xyz");
+  QCommandLineOption series_option(
+      "series", "SeriesInstanceUID of the series to convert.", "uid");
+  QCommandLineOption threads_option(
+      "threads", "Number of decoding threads, 0 for one per core.", "n", "0");
+  QCommandLineOption no_cache_option(
+      "no-cache", "Neither read nor write the decoded volume cache.");
+  QCommandLineOption window_center_option(
+      "window-center", "Center of the intensity window [HU].", "value");
+  QCommandLineOption window_width_option(
+      "window-width", "Width of the intensity window [HU].", "value");
+  QCommandLineOption auto_window_option(
+      "auto-window", "Compute the intensity window from the histogram.");
+  QCommandLineOption threshold_min_option(
+      "threshold-min", "Lowest extracted value [HU].", "value");
+  QCommandLineOption threshold_max_option(
+      "threshold-max", "Highest extracted value [HU].", "value");
+  QCommandLineOption contours_option(
+      "contours", "Only extract the contours of the segments.");
+  QCommandLineOption out_of_core_option(
+      "out-of-core",
+      "Convert through a brick file next to the output, keeping at most "
+      "<size> MB of voxels in memory.",
+      "size");
+  QCommandLineOption compress_option(
+      "compress", "Keep the volume compressed in memory and report the "
+                  "compression ratio.");
+  QCommandLineOption benchmark_kernels_option(
+      "benchmark-kernels",
+      "Time the generic and the specialised extraction kernels for each "
+      "contours neighbourhood instead of writing the points.");
+  QCommandLineOption color_option("color",
+                                  "Segment the voxels by tissue type.");
+  for (const QCommandLineOption &option :
+       {output_option, series_option, threads_option, no_cache_option,
+        window_center_option, window_width_option, auto_window_option,
+        threshold_min_option, threshold_max_option, contours_option,
+        color_option, out_of_core_option, compress_option,
+        benchmark_kernels_option})
+    parser.addOption(option);
+  parser.process(app);
+
+  if (parser.positionalArguments().size() != 1)
+    parser.showHelp(1);
+  BatchOptions options;
+  options.input_dir = parser.positionalArguments()[0].toStdString();
+  options.output_path = parser.value(output_option).toStdString();
+  options.series_uid = parser.value(series_option).toStdString();
+  options.nb_threads = parser.value(threads_option).toInt();
+  options.use_cache = !parser.isSet(no_cache_option);
+  options.contours_mode = parser.isSet(contours_option);
+  options.color_mode = parser.isSet(color_option);
+  options.has_window =
+      parser.isSet(window_center_option) || parser.isSet(window_width_option);
+  options.auto_window = parser.isSet(auto_window_option);
+  options.compress = parser.isSet(compress_option);
+  options.benchmark_kernels = parser.isSet(benchmark_kernels_option);
+  options.memory_cap = 0;
+  if (parser.isSet(out_of_core_option)) {
+    double size_mb;
+    if (!parseDouble(parser, out_of_core_option, "out-of-core", &size_mb))
+      return 1;
+    options.memory_cap = (size_t)(std::max(size_mb, 1.0) * 1024 * 1024);
+  }
+  options.has_threshold =
+      parser.isSet(threshold_min_option) || parser.isSet(threshold_max_option);
+  if (options.has_window &&
+      !(parseDouble(parser, window_center_option, "window-center",
+                    &options.window_center) &&
+        parseDouble(parser, window_width_option, "window-width",
+                    &options.window_width)))
+    return 1;
+  if (options.has_threshold &&
+      !(parseDouble(parser, threshold_min_option, "threshold-min",
+                    &options.threshold_min) &&
+        parseDouble(parser, threshold_max_option, "threshold-max",
+                    &options.threshold_max)))
+    return 1;
+
+  // Codec registration
+  DcmRLEDecoderRegistration::registerCodecs();
+  DJDecoderRegistration::registerCodecs();
+  DJLSDecoderRegistration::registerCodecs();
+
+  try {
+    run(options);
+  } catch (const DicomCollectionError &error) {
+    std::cerr << error.title << ": " << error.what() << std::endl;
+    return 1;
+  } catch (const std::exception &error) {
+    // Read errors of the brick files, or running out of memory
+    std::cerr << "Error: " << error.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+#-------------------------------------------------
+#
+# Headless conversion of a Dicom series to a point cloud
+#
+#-------------------------------------------------
+
+# QtGui is only required for QVector3D, no display is used
+QT       += core gui
+QT       -= widgets
+
+TARGET = dicom_batch
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+include(dicom_core.pri)
+
+SOURCES += \
+        dicom_batch.cpp
@@ -0,0 +1,652 @@
+#include "dicom_collection.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+
+#include "parallel.h"
+
+namespace {
+/// The result of a header scan performed by a worker
+struct ScanRecord {
+  std::vector<DicomSliceInfo> frames;
+  /// Set if the file could not be scanned
+  std::string error_title;
+  std::string error_msg;
+};
+
+/// A unit of work of the decoding workers: some frames of a single file
+/// - Each task loads its own DcmFileFormat, the tasks of a multi-frame file
+///   then read different frames without sharing a dataset
+struct DecodeTask {
+  std::string path;
+  std::vector<const DicomSliceInfo *> frames;
+  /// Set for multi-frame files, whose frames are read and decompressed one
+  /// at a time instead of converting the whole pixel data at once
+  bool partial;
+};
+
+/// Everything a decoding worker extracts from a task
+struct DecodeRecord {
+  std::shared_ptr<DcmFileFormat> file;
+  /// Set if the file could not be parsed
+  std::string open_error;
+  /// Set if the file was parsed but one of its images could not be decoded
+  std::string image_error;
+  double min_value = std::numeric_limits<double>::max();
+  double max_value = std::numeric_limits<double>::lowest();
+  /// Number of frames of the task which have been decoded
+  size_t nb_decoded = 0;
+};
+
+/// Number of frames of a multi-frame file handled by a single task, small
+/// enough to spread a large file over all the workers
+const size_t frames_per_task = 8;
+
+/// Retrieve the first item of the functional group 'group' of a frame, the
+/// per-frame group takes precedence over the shared one
+/// - return nullptr if the group is in none of them
+DcmItem *getFunctionalGroup(DcmItem *per_frame, DcmItem *shared,
+                            const DcmTagKey &group) {
+  DcmItem *item = nullptr;
+  if (per_frame != nullptr &&
+      per_frame->findAndGetSequenceItem(group, item, 0).good())
+    return item;
+  if (shared != nullptr &&
+      shared->findAndGetSequenceItem(group, item, 0).good())
+    return item;
+  return nullptr;
+}
+
+/// Fill the geometry, rescale and window of 'info' from the items holding
+/// them, 'value_transformation' and 'voi' are optional
+void readImageAttributes(DcmItem *plane_position, DcmItem *pixel_measures,
+                         DcmItem *value_transformation, DcmItem *voi,
+                         DicomSliceInfo *info) {
+  info->pixel_spacing = getPixelSpacing(pixel_measures);
+  info->position = getImagePosition(plane_position);
+  // Rescale and window are optional, neutral values are used when missing
+  info->slope = 1;
+  info->intercept = 0;
+  info->window_center = 0;
+  info->window_width = 1;
+  if (value_transformation != nullptr) {
+    value_transformation->findAndGetFloat64(DCM_RescaleSlope, info->slope);
+    value_transformation->findAndGetFloat64(DCM_RescaleIntercept,
+                                            info->intercept);
+  }
+  if (voi != nullptr) {
+    voi->findAndGetFloat64(DCM_WindowCenter, info->window_center);
+    voi->findAndGetFloat64(DCM_WindowWidth, info->window_width);
+  }
+}
+
+/// Load the file of 'task', large elements such as the pixel data are only
+/// read when accessed
+/// - return false on failure, the reason is stored in 'record'
+bool loadTaskFile(const DecodeTask &task, DecodeRecord *record) {
+  record->file = std::make_shared<DcmFileFormat>();
+  OFCondition status = record->file->loadFile(task.path.c_str());
+  if (status.bad()) {
+    record->open_error = task.path;
+    return false;
+  }
+  return true;
+}
+
+/// Read how the pixels of 'ds' are stored, the rescale is left neutral
+/// - return false if the format is not supported, the reason is stored in
+///   'record'
+bool getStoredPixelFormat(DcmDataset *ds, const std::string &path,
+                          StoredPixelFormat *format, DecodeRecord *record) {
+  Uint16 samples(1), bits_allocated(0), bits_stored(0),
+      pixel_representation(0);
+  ds->findAndGetUint16(DCM_SamplesPerPixel, samples);
+  ds->findAndGetUint16(DCM_BitsAllocated, bits_allocated);
+  ds->findAndGetUint16(DCM_BitsStored, bits_stored);
+  ds->findAndGetUint16(DCM_PixelRepresentation, pixel_representation);
+  if (bits_stored == 0)
+    bits_stored = bits_allocated;
+  if (samples != 1 || (bits_allocated != 8 && bits_allocated != 16) ||
+      bits_stored > bits_allocated) {
+    record->image_error = "Unsupported pixel format in file " + path;
+    return false;
+  }
+  format->bits_allocated = bits_allocated;
+  format->bits_stored = bits_stored;
+  format->is_signed = pixel_representation == 1;
+  format->slope = 1;
+  format->intercept = 0;
+  return true;
+}
+
+/// Gives access to the stored values of the frames of a dataset
+///
+/// The uncompressed pixel data of a single-frame file is used in place.
+/// Otherwise, frames are read and decompressed one at a time, so that a
+/// worker only touches the frames it decodes.
+class FrameReader {
+public:
+  FrameReader(DcmDataset *ds, bool partial, size_t frame_size)
+      : ds(ds), frame_size(frame_size), start_fragment(0) {
+    in_place = !partial && !DcmXfer(ds->getOriginalXfer()).isEncapsulated();
+  }
+
+  /// Return the stored values of 'frame' with 'bits_allocated' bits each,
+  /// valid until the next call
+  /// - return nullptr on failure, the reason is stored in 'error'
+  const void *getFrame(int frame, int bits_allocated, std::string *error) {
+    unsigned long count = 0;
+    if (in_place) {
+      const void *values = nullptr;
+      OFCondition status;
+      if (bits_allocated == 16) {
+        const Uint16 *words = nullptr;
+        status = ds->findAndGetUint16Array(DCM_PixelData, words, &count);
+        values = words;
+        count *= 2;
+      } else {
+        const Uint8 *bytes = nullptr;
+        status = ds->findAndGetUint8Array(DCM_PixelData, bytes, &count);
+        values = bytes;
+      }
+      if (status.bad() || count < (frame + 1) * frame_size) {
+        *error = "Invalid pixel data";
+        return nullptr;
+      }
+      return (const char *)values + frame * frame_size;
+    }
+    DcmElement *element = nullptr;
+    OFCondition status = ds->findAndGetElement(DCM_PixelData, element);
+    if (status.bad()) {
+      *error = status.text();
+      return nullptr;
+    }
+    DcmPixelData *pixel_data = (DcmPixelData *)element;
+    Uint32 size = 0;
+    status = pixel_data->getUncompressedFrameSize(ds, size);
+    if (status.bad() || size < frame_size) {
+      *error = "Invalid frame size";
+      return nullptr;
+    }
+    buffer.resize(size);
+    OFString color_model;
+    status = pixel_data->getUncompressedFrame(ds, frame, start_fragment,
+                                              buffer.data(), size,
+                                              color_model);
+    if (status.bad()) {
+      *error = status.text();
+      return nullptr;
+    }
+    return buffer.data();
+  }
+
+private:
+  DcmDataset *ds;
+  /// Size of a frame [bytes]
+  size_t frame_size;
+  /// Is the pixel data used in place?
+  bool in_place;
+  /// Receives the decompressed frames
+  std::vector<Uint8> buffer;
+  /// The fragment where the search for the next frame starts
+  Uint32 start_fragment;
+};
+} // namespace
+
+DicomCollectionError::DicomCollectionError(const std::string &title,
+                                           const std::string &msg)
+    : std::runtime_error(msg), title(title) {}
+
+DicomCollection::DicomCollection()
+    : min_value(std::numeric_limits<double>::max()),
+      max_value(std::numeric_limits<double>::lowest()), pixel_width(-1),
+      pixel_height(-1), slice_spacing(0), memory_lean(true) {}
+
+std::vector<DicomSliceInfo>
+DicomCollection::scanFile(const std::string &path) {
+  DcmFileFormat file;
+  // Parsing stops right before the pixel data, which is never read
+  OFCondition status =
+      file.loadFileUntilTag(path.c_str(), EXS_Unknown, EGL_noChange,
+                            DCM_MaxReadLength, ERM_autoDetect, DCM_PixelData);
+  if (status.bad())
+    throw DicomCollectionError("Failed to open file", path);
+  DcmDataset *ds = file.getDataset();
+  DicomSliceInfo info;
+  info.path = path;
+  info.patient_name = getPatientName(ds);
+  info.study_uid = getField<std::string>(ds, DCM_StudyInstanceUID);
+  info.series_uid = getField<std::string>(ds, DCM_SeriesInstanceUID);
+  info.frame = 0;
+  Uint16 rows(0), cols(0);
+  ds->findAndGetUint16(DCM_Rows, rows);
+  ds->findAndGetUint16(DCM_Columns, cols);
+  info.width = cols;
+  info.height = rows;
+  info.transfer_syntax = DcmXfer(ds->getOriginalXfer()).getXferID();
+
+  // Classic images carry their attributes at the root of the dataset
+  Sint32 nb_frames(1);
+  ds->findAndGetSint32(DCM_NumberOfFrames, nb_frames);
+  DcmItem *shared = nullptr;
+  ds->findAndGetSequenceItem(DCM_SharedFunctionalGroupsSequence, shared, 0);
+  if (nb_frames <= 1 && shared == nullptr) {
+    info.instance = getInstanceNumber(ds);
+    readImageAttributes(ds, ds, ds, ds, &info);
+    return {info};
+  }
+
+  // Enhanced multi-frame images describe each frame in functional groups
+  if (nb_frames < 1)
+    throw DicomCollectionError("Invalid multi-frame file",
+                               "No frame in " + path);
+  std::vector<DicomSliceInfo> frames;
+  for (int frame = 0; frame < nb_frames; frame++) {
+    DcmItem *per_frame = nullptr;
+    ds->findAndGetSequenceItem(DCM_PerFrameFunctionalGroupsSequence,
+                               per_frame, frame);
+    DcmItem *plane_position =
+        getFunctionalGroup(per_frame, shared, DCM_PlanePositionSequence);
+    DcmItem *pixel_measures =
+        getFunctionalGroup(per_frame, shared, DCM_PixelMeasuresSequence);
+    if (plane_position == nullptr || pixel_measures == nullptr)
+      throw DicomCollectionError(
+          "Invalid multi-frame file",
+          "Missing position or pixel spacing for frame " +
+              std::to_string(frame) + " of " + path);
+    DicomSliceInfo frame_info = info;
+    frame_info.frame = frame;
+    readImageAttributes(
+        plane_position, pixel_measures,
+        getFunctionalGroup(per_frame, shared,
+                           DCM_PixelValueTransformationSequence),
+        getFunctionalGroup(per_frame, shared, DCM_FrameVOILUTSequence),
+        &frame_info);
+    frames.push_back(frame_info);
+  }
+  // Frames are not necessarily sent in spatial order, their rank along z is
+  // used as instance number
+  std::stable_sort(frames.begin(), frames.end(),
+                   [](const DicomSliceInfo &a, const DicomSliceInfo &b) {
+                     return a.position[2] < b.position[2];
+                   });
+  for (size_t rank = 0; rank < frames.size(); rank++)
+    frames[rank].instance = rank + 1;
+  return frames;
+}
+
+void DicomCollection::scan(const std::vector<std::string> &paths,
+                           int nb_threads) {
+  // Reading all the headers concurrently
+  std::vector<ScanRecord> records(paths.size());
+  parallelFor(
+      0, paths.size(),
+      [&](size_t file_idx) {
+        try {
+          records[file_idx].frames = scanFile(paths[file_idx]);
+        } catch (const DicomCollectionError &error) {
+          records[file_idx].error_title = error.title;
+          records[file_idx].error_msg = error.what();
+        }
+      },
+      nb_threads);
+  std::vector<DicomSliceInfo> infos;
+  for (size_t file_idx = 0; file_idx < records.size(); file_idx++) {
+    ScanRecord &record = records[file_idx];
+    if (record.error_msg != "")
+      throw DicomCollectionError(record.error_title, record.error_msg);
+    // The instance numbers of the frames only make sense within their file
+    if (record.frames.size() > 1 && paths.size() > 1)
+      throw DicomCollectionError("Invalid file collection",
+                                 "Multi-frame file " + paths[file_idx] +
+                                     " must be opened alone");
+    for (DicomSliceInfo &info : record.frames)
+      infos.push_back(std::move(info));
+  }
+  validate(infos);
+}
+
+void DicomCollection::validate(const std::vector<DicomSliceInfo> &infos) {
+  // Building the slice table in the order of the selection
+  std::map<int, DicomSliceInfo> new_slices;
+  std::string new_patient;
+  double new_pixel_width(-1);
+  double new_pixel_height(-1);
+  for (size_t file_idx = 0; file_idx < infos.size(); file_idx++) {
+    const DicomSliceInfo &info = infos[file_idx];
+    // Checking patient
+    if (new_patient == "") {
+      new_patient = info.patient_name;
+    } else if (new_patient != info.patient_name) {
+      throw DicomCollectionError(
+          "Invalid file collection",
+          "At least 2 patients are present in the file collection: '" +
+              new_patient + "' and '" + info.patient_name + "'");
+    }
+    // Checking that instance number is not duplicated
+    if (new_slices.count(info.instance) > 0) {
+      throw DicomCollectionError("Duplicated instance idx",
+                                 "Instance " + std::to_string(info.instance) +
+                                     " is already loaded, cancelling load");
+    }
+    // Updating/checking pixel size
+    double frame_pixel_height = info.pixel_spacing[0];
+    double frame_pixel_width = info.pixel_spacing[1];
+    if (file_idx == 0) {
+      new_pixel_width = frame_pixel_width;
+      new_pixel_height = frame_pixel_height;
+    } else if (new_pixel_width != frame_pixel_width ||
+               new_pixel_height != frame_pixel_height) {
+      std::ostringstream msg_oss;
+      msg_oss << "Multiple pixel sizes found: " << new_pixel_width << "*"
+              << new_pixel_height << " and " << frame_pixel_width << "*"
+              << frame_pixel_height;
+      throw DicomCollectionError("Inconsistent collection", msg_oss.str());
+    }
+    new_slices[info.instance] = info;
+  }
+  // Check slice_spacing consistency
+  double new_slice_offset(0);
+  double new_slice_spacing(-1);
+  if (new_slices.size() <= 1) {
+    new_slice_spacing = 0;
+  } else {
+    int new_min_instance = new_slices.begin()->first;
+    int new_max_instance = new_slices.rbegin()->first;
+    // Deducing layer spacing and offset from extremum layers
+    const std::vector<double> &first_layer_position =
+        new_slices.begin()->second.position;
+    const std::vector<double> &last_layer_position =
+        new_slices.rbegin()->second.position;
+    new_slice_spacing = (last_layer_position[2] - first_layer_position[2]) /
+                        (new_max_instance - new_min_instance);
+    new_slice_offset =
+        first_layer_position[2] - new_min_instance * new_slice_spacing;
+    // Checking that all layers roughly respect the provided their expected
+    // position
+    double max_tol = 0.01; //[mm]
+    for (const auto &entry : new_slices) {
+      double expected_z = new_slice_spacing * entry.first + new_slice_offset;
+      double received_z = entry.second.position[2];
+      double error_z = fabs(expected_z - received_z);
+      if (error_z > max_tol) {
+        throw DicomCollectionError("Inconsistent collection",
+                                   "Slices are not regularly spaced, error: " +
+                                       std::to_string(error_z));
+      }
+    }
+  }
+
+  // The collection is only modified once all the checks passed
+  slices = std::move(new_slices);
+  files.clear();
+  patient_name = new_patient;
+  min_value = std::numeric_limits<double>::max();
+  max_value = std::numeric_limits<double>::lowest();
+  pixel_width = new_pixel_width;
+  pixel_height = new_pixel_height;
+  slice_spacing = new_slice_spacing;
+}
+
+void DicomCollection::decode(int nb_threads, VolumicData *volume,
+                             const std::atomic<bool> *cancel,
+                             const std::function<void(int)> &on_slice_decoded) {
+  files.clear();
+  double new_min = std::numeric_limits<double>::max();
+  double new_max = std::numeric_limits<double>::lowest();
+  decodeLayers(0, getMaxInstance() - getMinInstance() + 1, nb_threads, volume,
+               cancel, on_slice_decoded, &new_min, &new_max);
+  min_value = new_min;
+  max_value = new_max;
+}
+
+void DicomCollection::decodeSlab(int first_layer, VolumicData *slab,
+                                 int nb_threads) {
+  decodeLayers(first_layer, first_layer + slab->depth, nb_threads, slab,
+               nullptr, nullptr, &min_value, &max_value);
+}
+
+void DicomCollection::decodeLayers(
+    int layer_begin, int layer_end, int nb_threads, VolumicData *volume,
+    const std::atomic<bool> *cancel,
+    const std::function<void(int)> &on_slice_decoded, double *min,
+    double *max) {
+  int min_instance = getMinInstance();
+  // Grouping the frames by file in instance order, multi-frame files are
+  // split in several tasks so that they are decoded by all the workers
+  std::vector<std::vector<const DicomSliceInfo *>> groups;
+  std::map<std::string, size_t> group_of_path;
+  for (const auto &entry : slices) {
+    int layer = entry.first - min_instance;
+    if (layer < layer_begin || layer >= layer_end)
+      continue;
+    const std::string &path = entry.second.path;
+    if (group_of_path.count(path) == 0) {
+      group_of_path[path] = groups.size();
+      groups.emplace_back();
+    }
+    groups[group_of_path.at(path)].push_back(&entry.second);
+  }
+  std::vector<DecodeTask> tasks;
+  for (const std::vector<const DicomSliceInfo *> &group : groups) {
+    for (size_t start = 0; start < group.size(); start += frames_per_task) {
+      DecodeTask task;
+      task.path = group[0]->path;
+      task.partial = group.size() > 1;
+      task.frames.assign(group.begin() + start,
+                         group.begin() +
+                             std::min(group.size(), start + frames_per_task));
+      tasks.push_back(task);
+    }
+  }
+  // Creating the entries of all the files before starting, so that the
+  // workers never modify the structure of the map
+  for (const std::vector<const DicomSliceInfo *> &group : groups)
+    for (const DicomSliceInfo *info : group)
+      files[info->instance] = nullptr;
+
+  // Parsing and decoding all the tasks concurrently
+  std::vector<DecodeRecord> records(tasks.size());
+  parallelFor(
+      0, tasks.size(),
+      [&](size_t idx) {
+        if (cancel != nullptr && *cancel)
+          return;
+        const DecodeTask &task = tasks[idx];
+        DecodeRecord &record = records[idx];
+        if (!loadTaskFile(task, &record))
+          return;
+        DcmDataset *ds = record.file->getDataset();
+        StoredPixelFormat format;
+        if (!getStoredPixelFormat(ds, task.path, &format, &record))
+          return;
+        const DicomSliceInfo &first = *task.frames[0];
+        size_t nb_pixels = (size_t)first.width * first.height;
+        FrameReader reader(ds, task.partial,
+                           nb_pixels * format.bits_allocated / 8);
+        // Without volume, the frames are only decoded to get their range
+        std::vector<int16_t> scratch;
+        if (volume == nullptr)
+          scratch.resize(nb_pixels);
+        for (const DicomSliceInfo *info : task.frames) {
+          if (cancel != nullptr && *cancel)
+            break;
+          // The destination is exactly one layer, a different size would
+          // leave part of it undefined
+          if (volume != nullptr && (info->width != volume->width ||
+                                    info->height != volume->height)) {
+            record.image_error = "Unexpected image size in file " + task.path;
+            return;
+          }
+          const void *stored =
+              reader.getFrame(info->frame, format.bits_allocated,
+                              &record.image_error);
+          if (stored == nullptr) {
+            record.image_error =
+                "Can't read image at file " + task.path + ": " +
+                record.image_error;
+            return;
+          }
+          // Stored values are rescaled straight into their layer
+          format.slope = info->slope;
+          format.intercept = info->intercept;
+          if (volume != nullptr)
+            volume->fillLayer(stored, format,
+                              info->instance - min_instance - layer_begin,
+                              &record.min_value, &record.max_value);
+          else
+            rescalePixels(stored, format, nb_pixels, 0, 0, scratch.data(),
+                          &record.min_value, &record.max_value);
+          record.nb_decoded++;
+        }
+        // The pixel data is released, the volume holds the only remaining
+        // copy of the pixels
+        if (volume != nullptr && memory_lean)
+          ds->findAndDeleteElement(DCM_PixelData);
+        // The file has to be available before the layers are flagged as ready
+        for (size_t frame_idx = 0; frame_idx < record.nb_decoded; frame_idx++)
+          files.at(task.frames[frame_idx]->instance) = record.file;
+        for (size_t frame_idx = 0; frame_idx < record.nb_decoded;
+             frame_idx++) {
+          int instance = task.frames[frame_idx]->instance;
+          if (volume != nullptr)
+            volume->setLayerReady(instance - min_instance - layer_begin);
+          if (on_slice_decoded)
+            on_slice_decoded(instance);
+        }
+      },
+      nb_threads);
+
+  // Reducing the records in instance order
+  double new_min = *min;
+  double new_max = *max;
+  for (const DecodeRecord &record : records) {
+    if (record.open_error != "")
+      throw DicomCollectionError("Failed to open file", record.open_error);
+    // All the Dicom file should contain loadable images
+    if (record.image_error != "")
+      throw DicomCollectionError("Invalid file", record.image_error);
+    if (record.nb_decoded == 0)
+      continue;
+    new_min = std::min(record.min_value, new_min);
+    new_max = std::max(record.max_value, new_max);
+  }
+  *min = new_min;
+  *max = new_max;
+}
+
+std::unique_ptr<VolumicData> DicomCollection::createVolume() const {
+  return createSlab(getMaxInstance() - getMinInstance() + 1);
+}
+
+std::unique_ptr<VolumicData> DicomCollection::createSlab(int nb_layers) const {
+  const DicomSliceInfo &first = slices.begin()->second;
+  double win_min = first.window_center - first.window_width / 2;
+  double win_max = first.window_center + first.window_width / 2;
+  std::unique_ptr<VolumicData> volume(
+      new VolumicData(first.width, first.height, nb_layers, win_min, win_max));
+  volume->pixel_width = pixel_width;
+  volume->pixel_height = pixel_height;
+  volume->slice_spacing = slice_spacing;
+  return volume;
+}
+
+DcmDataset *DicomCollection::getDataset(int instance) {
+  std::shared_ptr<DcmFileFormat> &file = files[instance];
+  if (!file) {
+    const std::string &path = slices.at(instance).path;
+    file = std::make_shared<DcmFileFormat>();
+    OFCondition status =
+        memory_lean ? file->loadFileUntilTag(path.c_str(), EXS_Unknown,
+                                             EGL_noChange, DCM_MaxReadLength,
+                                             ERM_autoDetect, DCM_PixelData)
+                    : file->loadFile(path.c_str());
+    if (status.bad()) {
+      std::cerr << "Failed to load " << path << ": " << status.text()
+                << std::endl;
+      file.reset();
+      return nullptr;
+    }
+    // The other frames of a multi-frame file share the loaded file
+    for (const auto &entry : slices) {
+      std::shared_ptr<DcmFileFormat> &other = files[entry.first];
+      if (!other && entry.second.path == path)
+        other = file;
+    }
+  }
+  return file->getDataset();
+}
+
+int DicomCollection::getMinInstance() const { return slices.begin()->first; }
+
+int DicomCollection::getMaxInstance() const { return slices.rbegin()->first; }
+
+void DicomCollection::load(const std::vector<std::string> &paths,
+                           int nb_threads) {
+  scan(paths, nb_threads);
+  decode(nb_threads);
+}
+
+std::string getPatientName(DcmItem *item) {
+  return getField<std::string>(item, DCM_PatientName);
+}
+
+std::vector<double> getPixelSpacing(DcmItem *item) {
+  return getFieldVector<double>(item, DcmTagKey(0x28, 0x30), 2);
+}
+
+std::vector<double> getImagePosition(DcmItem *item) {
+  return getFieldVector<double>(item, DcmTagKey(0x20, 0x32), 3);
+}
+
+int getSeriesNumber(DcmItem *item) { return getField<int>(item, 0x20, 0x11); }
+int getInstanceNumber(DcmItem *item) {
+  return getField<int>(item, 0x20, 0x13);
+}
+int getAcquisitionNumber(DcmItem *item) {
+  return getField<int>(item, 0x20, 0x12);
+}
+
+template <>
+double getField<double>(DcmItem *item, const DcmTagKey &tag_key,
+                        unsigned long pos) {
+  double value;
+  OFCondition status = item->findAndGetFloat64(tag_key, value, pos);
+  if (status.bad())
+    std::cerr << "Error on tag: " << tag_key << " -> " << status.text()
+              << std::endl;
+  return value;
+}
+template <>
+short int getField<short int>(DcmItem *item, const DcmTagKey &tag_key,
+                              unsigned long pos) {
+  short int value;
+  OFCondition status = item->findAndGetSint16(tag_key, value, pos);
+  if (status.bad())
+    std::cerr << "Error on tag: " << tag_key << " -> " << status.text()
+              << std::endl;
+  return value;
+}
+template <>
+int getField<int>(DcmItem *item, const DcmTagKey &tag_key, unsigned long pos) {
+  int value;
+  OFCondition status = item->findAndGetSint32(tag_key, value, pos);
+  if (status.bad())
+    std::cerr << "Error on tag: " << tag_key << " -> " << status.text()
+              << std::endl;
+  return value;
+}
+template <>
+std::string getField<std::string>(DcmItem *item, const DcmTagKey &tag_key,
+                                  unsigned long pos) {
+  OFString value;
+  OFCondition status = item->findAndGetOFStringArray(tag_key, value, pos);
+  if (status.bad())
+    std::cerr << "Error on tag: " << tag_key << " -> " << status.text()
+              << std::endl;
+  return value.c_str();
+}
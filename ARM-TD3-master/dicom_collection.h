@@ -0,0 +1,224 @@
+#ifndef DICOM_COLLECTION_H
+#define DICOM_COLLECTION_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dcmtk/dcmdata/dctk.h>
+
+#include "volumic_data.h"
+
+/// Raised when a set of files does not form a valid collection
+class DicomCollectionError : public std::runtime_error {
+public:
+  DicomCollectionError(const std::string &title, const std::string &msg);
+
+  /// A short description of the failure, suited for a dialog title
+  std::string title;
+};
+
+/// The metadata of a single slice, read without touching its pixel data
+///
+/// A classic file holds a single slice, while each frame of an enhanced
+/// multi-frame file is a slice of its own
+struct DicomSliceInfo {
+  std::string path;
+  std::string patient_name;
+  std::string study_uid;
+  std::string series_uid;
+  /// Instance number of the file, or rank along z of the frame for
+  /// multi-frame files
+  int instance;
+  /// Index of the frame in the file, 0 for single-frame files
+  int frame;
+  /// [row_spacing, col_spacing] in mm
+  std::vector<double> pixel_spacing;
+  /// [x,y,z] of the first voxel transmitted in mm
+  std::vector<double> position;
+  /// Number of columns of the image
+  int width;
+  /// Number of rows of the image
+  int height;
+  double slope;
+  double intercept;
+  /// Default window provided by the file
+  double window_center;
+  double window_width;
+  /// UID of the transfer syntax used in the file
+  std::string transfer_syntax;
+};
+
+/// A set of Dicom files describing a single regularly spaced volume
+class DicomCollection {
+public:
+  /// The metadata of the slices, indexed by instance number
+  std::map<int, DicomSliceInfo> slices;
+
+  /// The files of the collection, indexed by instance number
+  /// - empty until 'decode' has been called
+  /// - in memory-lean mode, their PixelData is dropped once copied to the
+  ///   volume
+  /// - the frames of a multi-frame file decoded by the same task share the
+  ///   same object, each task loading its own one since a DcmDataset can not
+  ///   be read by several workers at once. Frames loaded by getDataset share
+  ///   a single object.
+  std::map<int, std::shared_ptr<DcmFileFormat>> files;
+
+  /// The name of the patient the collection concerns
+  std::string patient_name;
+  /// Minimal value used among the whole collection
+  /// - written by decode when it returns, not to be read while another
+  ///   thread decodes the collection
+  double min_value;
+  /// Maximal value used among the whole collection
+  double max_value;
+  /// The width of a pixel in [mm]
+  double pixel_width;
+  /// The height of a pixel in [mm]
+  double pixel_height;
+  /// The space between two consecutive slices [mm]
+  /// - 0 if less than 2 images are loaded
+  double slice_spacing;
+
+  /// When set, the files only retain their metadata once their pixels have
+  /// been written to the volume, which then becomes the only copy of them
+  bool memory_lean;
+
+  DicomCollection();
+
+  /// Read the headers of all the files and check that they form a consistent
+  /// collection, without decoding any pixel data
+  ///
+  /// Headers are read up to the PixelData element by a pool of 'nb_threads'
+  /// workers (one per core if <= 0). Unreadable files are reported first,
+  /// then the slice table is validated in the order of 'paths'.
+  ///
+  /// A multi-frame file is split in one slice per frame, it can not be mixed
+  /// with other files.
+  ///
+  /// Throws a DicomCollectionError if the files are not a valid collection
+  void scan(const std::vector<std::string> &paths, int nb_threads = 0);
+
+  /// Build the slice table from headers which have already been read (e.g.
+  /// from a SeriesIndex) and check that they form a consistent collection
+  ///
+  /// Throws a DicomCollectionError if the slices are not a valid collection
+  void validate(const std::vector<DicomSliceInfo> &infos);
+
+  /// Fully load and decode the files of the scanned slices, reducing the
+  /// collection min/max on the fly
+  ///
+  /// - If 'volume' is provided, each decoded slice is written to its layer,
+  ///   which is then flagged as ready
+  /// - 'on_slice_decoded(instance)' is called from the workers once a slice
+  ///   is available in 'files' (and 'volume')
+  /// - Once '*cancel' is set, the remaining slices are skipped
+  /// - The frames of multi-frame files are spread over the workers, each of
+  ///   them reading and decompressing only the frames it decodes
+  /// - In memory-lean mode, the PixelData of a slice is dropped from its
+  ///   file once written to 'volume'
+  ///
+  /// While decoding, 'files' only receives new entries for the ready slices,
+  /// it can therefore be read concurrently for those slices.
+  ///
+  /// Throws a DicomCollectionError if a file can not be loaded or decoded,
+  /// once all the other slices have been processed
+  void decode(int nb_threads = 0, VolumicData *volume = nullptr,
+              const std::atomic<bool> *cancel = nullptr,
+              const std::function<void(int)> &on_slice_decoded = nullptr);
+
+  /// Decode the slices of the layers [first_layer, first_layer + depth) of
+  /// the volume to 'slab', whose layer 0 receives 'first_layer'
+  /// - The collection min/max is extended with the decoded slices, 'files'
+  ///   keeps the entries of the slices decoded by previous calls
+  /// - Used to convert volumes which do not fit in memory, one slab at a
+  ///   time
+  ///
+  /// Throws a DicomCollectionError if a file can not be loaded or decoded
+  void decodeSlab(int first_layer, VolumicData *slab, int nb_threads = 0);
+
+  /// Build an empty volume with the dimensions, spacing and default window
+  /// of the scanned slices, none of its layers is ready
+  std::unique_ptr<VolumicData> createVolume() const;
+  /// Same as 'createVolume' with only 'nb_layers' layers, to be filled by
+  /// 'decodeSlab'
+  std::unique_ptr<VolumicData> createSlab(int nb_layers) const;
+
+  /// Retrieve the dataset of a decoded slice, the file is loaded if it is not
+  /// retained (e.g. volume restored from a cache), without its PixelData in
+  /// memory-lean mode
+  /// - return nullptr if the file can not be loaded
+  DcmDataset *getDataset(int instance);
+
+  int getMinInstance() const;
+  int getMaxInstance() const;
+
+  /// Scan and decode the given files
+  void load(const std::vector<std::string> &paths, int nb_threads = 0);
+
+  /// Read the metadata of the file at 'path' stopping at the PixelData element
+  /// Return one entry per frame, multi-frame files are described by their
+  /// shared and per-frame functional groups
+  ///
+  /// Throws a DicomCollectionError if the file can not be parsed
+  static std::vector<DicomSliceInfo> scanFile(const std::string &path);
+
+private:
+  /// Decode the slices of the layers [layer_begin, layer_end) to 'volume',
+  /// whose layer 0 receives 'layer_begin', see 'decode'
+  /// - The range of the decoded values is reduced into 'min' and 'max'
+  void decodeLayers(int layer_begin, int layer_end, int nb_threads,
+                    VolumicData *volume, const std::atomic<bool> *cancel,
+                    const std::function<void(int)> &on_slice_decoded,
+                    double *min, double *max);
+};
+
+std::string getPatientName(DcmItem *item);
+
+// Returns a two elements vector with [row_spacing, col_spacing] in mm
+std::vector<double> getPixelSpacing(DcmItem *item);
+
+// Returns the position of the first voxel transmitted in a three elements
+// vector with [x,y,z] in mm
+std::vector<double> getImagePosition(DcmItem *item);
+
+int getSeriesNumber(DcmItem *item);
+int getInstanceNumber(DcmItem *item);
+int getAcquisitionNumber(DcmItem *item);
+
+template <typename T>
+T getField(DcmItem *item, const DcmTagKey &tag_key, unsigned long pos = 0);
+template <typename T>
+T getField(DcmItem *item, unsigned int g, unsigned int e,
+           unsigned long pos = 0) {
+  return getField<T>(item, DcmTagKey(g, e), pos);
+}
+
+template <>
+double getField<double>(DcmItem *item, const DcmTagKey &tag_key,
+                        unsigned long pos);
+template <>
+short int getField<short int>(DcmItem *item, const DcmTagKey &tag_key,
+                              unsigned long pos);
+template <>
+int getField<int>(DcmItem *item, const DcmTagKey &tag_key, unsigned long pos);
+template <>
+std::string getField<std::string>(DcmItem *item, const DcmTagKey &tag_key,
+                                  unsigned long pos);
+
+template <typename T>
+std::vector<T> getFieldVector(DcmItem *item, const DcmTagKey &tag_key,
+                              int fixed_size) {
+  std::vector<T> result(fixed_size);
+  for (int i = 0; i < fixed_size; i++) {
+    result[i] = getField<T>(item, tag_key, i);
+  }
+  return result;
+}
+
+#endif // DICOM_COLLECTION_H
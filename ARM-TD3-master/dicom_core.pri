@@ -0,0 +1,45 @@
+# Loading, volume and point extraction code shared by dicom_viewer and
+# dicom_batch, it does not depend on QtWidgets
+
+CONFIG += c++14
+
+SOURCES += \
+        $$PWD/dicom_collection.cpp \
+        $$PWD/series_index.cpp \
+        $$PWD/volumic_data.cpp \
+        $$PWD/volume_cache.cpp \
+        $$PWD/point_extractor.cpp \
+        $$PWD/bricked_volume.cpp \
+        $$PWD/volume_pyramid.cpp \
+        $$PWD/histogram.cpp \
+        $$PWD/out_of_core_volume.cpp \
+        $$PWD/compressed_volume.cpp \
+        $$PWD/rescale_kernel.cpp \
+        $$PWD/voxel_classifier.cpp \
+        $$PWD/label_volume.cpp
+
+HEADERS += \
+        $$PWD/dicom_collection.h \
+        $$PWD/series_index.h \
+        $$PWD/parallel.h \
+        $$PWD/volumic_data.h \
+        $$PWD/volume_cache.h \
+        $$PWD/point_extractor.h \
+        $$PWD/bricked_volume.h \
+        $$PWD/volume_pyramid.h \
+        $$PWD/histogram.h \
+        $$PWD/out_of_core_volume.h \
+        $$PWD/compressed_volume.h \
+        $$PWD/rescale_kernel.h \
+        $$PWD/voxel_classifier.h \
+        $$PWD/label_volume.h
+
+INCLUDEPATH += $$PWD
+
+LIBS += \
+        -ldcmdata \
+        -ldcmimage \
+        -ldcmimgle \
+        -lofstd \
+        -ldcmjpeg \
+        -ldcmjpls
@@ -1,20 +1,28 @@
 #include "dicom_viewer.h"
 
+#include <algorithm>
+#include <cmath>
+#include <exception>
 #include <iostream>
 #include <set>
 
+#include <QDir>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QInputDialog>
 #include <QMenuBar>
 #include <QMessageBox>
+#include <QStatusBar>
 
 #include <dcmtk/dcmdata/dcrledrg.h>
 #include <dcmtk/dcmjpeg/djdecode.h>
+#include <dcmtk/dcmjpls/djdecode.h>
 
 DicomViewer::DicomViewer(QWidget *parent)
-    : QMainWindow(parent), image(nullptr), img_data(nullptr), pixel_width(-1),
-      pixel_height(-1), slice_spacing(0),
-      collection_min(std::numeric_limits<double>::max()),
-      collection_max(std::numeric_limits<double>::lowest()) {
+    : QMainWindow(parent), volume(nullptr), collection_min_value(0),
+      collection_max_value(0), from_cache(false), cancel_load(false),
+      load_id(0),
+      cache_signature(0) {
   // Setting layout
   widget = new QWidget();
   setCentralWidget(widget);
@@ -63,6 +71,16 @@ DicomViewer::DicomViewer(QWidget *parent)
   open_collection_action->setShortcut(QKeySequence::Open);
   QObject::connect(open_collection_action, SIGNAL(triggered()), this,
                    SLOT(openDicomCollection()));
+  QAction *open_directory_action = file_menu->addAction("Open &directory");
+  QObject::connect(open_directory_action, SIGNAL(triggered()), this,
+                   SLOT(openDicomDirectory()));
+  QAction *cancel_load_action = file_menu->addAction("&Cancel loading");
+  cancel_load_action->setShortcut(QKeySequence(Qt::Key_Escape));
+  QObject::connect(cancel_load_action, SIGNAL(triggered()), this,
+                   SLOT(cancelLoad()));
+  memory_lean_action = file_menu->addAction("&Memory-lean mode");
+  memory_lean_action->setCheckable(true);
+  memory_lean_action->setChecked(true);
   QAction *save_action = file_menu->addAction("&Save");
   save_action->setShortcut(QKeySequence::Save);
   QObject::connect(save_action, SIGNAL(triggered()), this, SLOT(save()));
@@ -71,6 +89,10 @@ DicomViewer::DicomViewer(QWidget *parent)
   saveXYZ_action->setShortcut(QKeySequence::SaveAs);
   QObject::connect(saveXYZ_action, SIGNAL(triggered()), gl_widget, SLOT(saveXYZ()));
 
+  QAction *auto_window_action = file_menu->addAction("&Auto window");
+  QObject::connect(auto_window_action, SIGNAL(triggered()), this,
+                   SLOT(applyAutoWindow()));
+
   QAction *help_action = file_menu->addAction("&Help");
   help_action->setShortcut(QKeySequence::HelpContents);
   QObject::connect(help_action, SIGNAL(triggered()), this, SLOT(showStats()));
@@ -105,9 +127,20 @@ DicomViewer::DicomViewer(QWidget *parent)
   connect(color_mode, SIGNAL(stateChanged(int)), gl_widget,
           SLOT(onColorModeChange(int)));
 
+  // Background loading connection
+  refresh_timer = new QTimer(this);
+  refresh_timer->setSingleShot(true);
+  refresh_timer->setInterval(200);
+  connect(refresh_timer, SIGNAL(timeout()), this, SLOT(refreshVolume()));
+  connect(this, SIGNAL(sliceDecoded(int, int)), this,
+          SLOT(onSliceDecoded(int, int)));
+  connect(this, SIGNAL(loadFinished(int, QString, QString)), this,
+          SLOT(onLoadFinished(int, QString, QString)));
+
   // Codec registration
   DcmRLEDecoderRegistration::registerCodecs();
   DJDecoderRegistration::registerCodecs();
+  DJLSDecoderRegistration::registerCodecs();
 
   // Update basic display elements
   updateInstanceLimits();
@@ -118,7 +151,7 @@ DicomViewer::DicomViewer(QWidget *parent)
   alpha_slider->setValue(gl_widget->getAlpha());
 }
 
-DicomViewer::~DicomViewer() {}
+DicomViewer::~DicomViewer() { cancelLoad(); }
 
 void DicomViewer::openDicomCollection() {
   QStringList files = QFileDialog::getOpenFileNames(
@@ -126,140 +159,213 @@ void DicomViewer::openDicomCollection() {
   // If no file has been selected, don't change anything
   if (files.size() == 0)
     return;
-  // TODO: this code section clearly exhibits that it would be way better to
-  // encapsulate the DicomCollection in a class with several attributes, to load
-  // it and then to have a collection = std::move(new_collection)
-
-  // First reading all the collection properties in temporary variables to
-  // avoid modification of the current data if provided files are invalid
-  std::map<int, std::unique_ptr<DcmFileFormat>> new_files;
-  std::string new_patient;
-  double new_collection_min = std::numeric_limits<double>::max();
-  double new_collection_max = std::numeric_limits<double>::lowest();
-  double new_pixel_width(-1);
-  double new_pixel_height(-1);
-  for (int file_idx = 0; file_idx < files.size(); file_idx++) {
-    const QString &file = files[file_idx];
-    std::string path = file.toStdString();
-    std::unique_ptr<DcmFileFormat> dcm_file(new DcmFileFormat());
-    OFCondition status;
-    status = dcm_file->loadFile(path.c_str());
-    if (status.bad()) {
-      QMessageBox::critical(this, "Failed to open file", path.c_str());
-      return;
-    }
-    DcmDataset *file_ds = dcm_file->getDataset();
-    // Checking patient
-    std::string file_patient = getPatientName(file_ds);
-    if (new_patient == "") {
-      new_patient = file_patient;
-    } else if (new_patient != file_patient) {
-      std::string msg =
-          "At least 2 patients are present in the file collection: '" +
-          new_patient + "' and '" + file_patient + "'";
-      QMessageBox::critical(this, "Invalid file collection", msg.c_str());
-      return;
-    }
+  std::vector<std::string> paths;
+  for (const QString &file : files)
+    paths.push_back(file.toStdString());
+  // Scanning the collection in a temporary object to avoid modification of
+  // the current data if provided files are invalid
+  std::unique_ptr<DicomCollection> new_collection(new DicomCollection());
+  try {
+    new_collection->scan(paths);
+  } catch (const DicomCollectionError &error) {
+    QMessageBox::critical(this, error.title.c_str(), error.what());
+    return;
+  }
+  // Raw file selections are not cached
+  cache_path = "";
+  setCollection(std::move(new_collection));
+}
 
-    int instance_number = getInstanceNumber(file_ds);
-    // Checking that instance number is not duplicated
-    if (new_files.count(instance_number) > 0) {
-      std::string msg = "Instance " + std::to_string(instance_number) +
-                        " is already loaded, cancelling load";
-      QMessageBox::critical(this, "Duplicated instance idx", msg.c_str());
-      return;
-    }
-    // All the Dicom file should contain loadable images
-    DicomImage *img = loadDicomImage(file_ds);
-    if (img == nullptr) {
-      QMessageBox::critical(this, "Invalid file",
-                            ("Can't read image at file " + path).c_str());
-      return;
-    }
-    // Updating min and max of collection
-    double frame_min, frame_max;
-    getFrameMinMax(img, &frame_min, &frame_max);
-    new_collection_min = std::min(frame_min, new_collection_min);
-    new_collection_max = std::max(frame_max, new_collection_max);
-    new_files[instance_number] = std::move(dcm_file);
-    // Updating/checking pixel_width
-    std::vector<double> pixel_spacing = getPixelSpacing(file_ds);
-    double frame_pixel_height = pixel_spacing[0];
-    double frame_pixel_width = pixel_spacing[1];
-    if (file_idx == 0) {
-      new_pixel_width = frame_pixel_width;
-      new_pixel_height = frame_pixel_height;
-    } else if (new_pixel_width != frame_pixel_width ||
-               new_pixel_height != frame_pixel_height) {
-      std::ostringstream msg_oss;
-      msg_oss << "Multiple pixel sizes found: " << new_pixel_width << "*"
-              << new_pixel_height << " and " << frame_pixel_width << "*"
-              << frame_pixel_height;
-      QMessageBox::critical(this, "Inconsistent collection",
-                            msg_oss.str().c_str());
-      return;
-    }
+void DicomViewer::openDicomDirectory() {
+  QString dir = QFileDialog::getExistingDirectory(this, "Select directory");
+  if (dir.isEmpty())
+    return;
+  SeriesIndex index(dir.toStdString());
+  index.update();
+  std::cout << "Indexed " << dir.toStdString() << ": "
+            << index.nb_parsed_files << " files parsed, "
+            << index.nb_cached_files << " files reused" << std::endl;
+  if (index.series.size() == 0) {
+    QMessageBox::warning(this, "No series found",
+                         "No Dicom series found in " + dir);
+    return;
   }
-  // Check slice_spacing consistency
-  double new_slice_offset(0);
-  double new_slice_spacing(-1);
-  if (new_files.size() <= 1) {
-    new_slice_spacing = 0;
-  } else {
-    int new_min_instance = new_files.begin()->first;
-    int new_max_instance = new_files.rbegin()->first;
-    // Deducing layer spacing and offset from extremum layers
-    std::vector<double> first_layer_position =
-        getImagePosition(new_files.begin()->second->getDataset());
-    std::vector<double> last_layer_position =
-        getImagePosition(new_files.rbegin()->second->getDataset());
-    new_slice_spacing = (last_layer_position[2] - first_layer_position[2]) /
-                        (new_max_instance - new_min_instance);
-    new_slice_offset =
-        first_layer_position[2] - new_min_instance * new_slice_spacing;
-    // Checking that all layers roughly respect the provided their expected
-    // position
-    double max_tol = 0.01; //[mm]
-    for (const auto &entry : new_files) {
-      double expected_z = new_slice_spacing * entry.first + new_slice_offset;
-      double received_z = getImagePosition(entry.second->getDataset())[2];
-      double error_z = fabs(expected_z - received_z);
-      if (error_z > max_tol) {
-        std::string msg = "Slices are not regularly spaced, error: " +
-                          std::to_string(error_z);
-        QMessageBox::critical(this, "Inconsistent collection", msg.c_str());
-        return;
-      }
-    }
+  // Letting the user choose among the available series
+  QStringList choices;
+  std::vector<const DicomSeries *> choices_series;
+  for (const auto &entry : index.series) {
+    const DicomSeries &series = entry.second;
+    std::ostringstream oss;
+    oss << series.patient_name << " - " << series.series_uid << " ("
+        << series.slices.size() << " slices)";
+    choices << QString::fromStdString(oss.str());
+    choices_series.push_back(&series);
+  }
+  int choice_idx = 0;
+  if (choices.size() > 1) {
+    bool ok = false;
+    QString choice = QInputDialog::getItem(this, "Select series", "Series:",
+                                           choices, 0, false, &ok);
+    if (!ok)
+      return;
+    choice_idx = choices.indexOf(choice);
   }
+  openDicomSeries(*choices_series[choice_idx]);
+}
 
-  // Replacing current elements
-  active_files.clear();
-  for (auto &entry : new_files) {
-    active_files[entry.first] = std::move(entry.second);
+void DicomViewer::openDicomSeries(const DicomSeries &series) {
+  std::unique_ptr<DicomCollection> new_collection(new DicomCollection());
+  try {
+    new_collection->validate(series.slices);
+  } catch (const DicomCollectionError &error) {
+    QMessageBox::critical(this, error.title.c_str(), error.what());
+    return;
+  }
+  cache_path = series.cache_path;
+  cache_signature = series.signature;
+  // Mapping the volume from the cache if the series did not change since it
+  // was written, which avoids decoding any slice
+  VolumeCacheInfo cache_info;
+  std::unique_ptr<VolumicData> cached_volume =
+      openVolumeCache(cache_path, cache_signature, &cache_info);
+  if (cached_volume) {
+    new_collection->min_value = cache_info.min_value;
+    new_collection->max_value = cache_info.max_value;
   }
-  patient_name = new_patient;
-  collection_min = new_collection_min;
-  collection_max = new_collection_max;
-  pixel_height = new_pixel_height;
-  pixel_width = new_pixel_width;
-  slice_spacing = new_slice_spacing;
-
-  // Updating all the internal members based on the new data
+  setCollection(std::move(new_collection), std::move(cached_volume));
+}
+
+void DicomViewer::setCollection(
+    std::unique_ptr<DicomCollection> new_collection,
+    std::unique_ptr<VolumicData> decoded_volume) {
+  // Replacing current elements, the previous loading thread must be stopped
+  // before its collection is destroyed
+  cancelLoad();
+  loaded_pyramid.reset();
+  collection = std::move(new_collection);
+  collection->memory_lean = memory_lean_action->isChecked();
+  bool needs_decoding = !decoded_volume;
+  from_cache = !needs_decoding;
+  collection_min_value = collection->min_value;
+  collection_max_value = collection->max_value;
+  volume = needs_decoding ? collection->createVolume()
+                          : std::move(decoded_volume);
+  gl_widget->updateVolumicData(volume);
+
+  // Updating all the internal members based on the new headers, the slices
+  // are shown as soon as they are decoded
   updateInstanceLimits();
   int expected_instances = max_instance - min_instance + 1;
-  if (active_files.size() != (size_t)expected_instances) {
+  if (collection->slices.size() != (size_t)expected_instances) {
     std::string msg = "Expecting " + std::to_string(expected_instances) +
                       " instances, received " +
-                      std::to_string(active_files.size()) + " instances";
+                      std::to_string(collection->slices.size()) + " instances";
     QMessageBox::warning(this, "Missing instances", msg.c_str());
   }
   updateSliceSlider();
-  loadDicomImage();
   updateWindowSliders();
   applyDefaultWindow();
   updateImage();
-  updateVolumicData();
+
+  // Decoding the slices if needed, then building the levels of detail of
+  // the volume in background
+  cancel_load = false;
+  load_id++;
+  int id = load_id;
+  DicomCollection *loading_collection = collection.get();
+  std::shared_ptr<VolumicData> loading_volume = volume;
+  VolumeCacheInfo cache_info;
+  cache_info.signature = cache_signature;
+  std::string loading_cache_path = cache_path;
+  int nb_levels = gl_widget->max_pyramid_levels;
+  PyramidReduction reduction = gl_widget->pyramid_reduction;
+  load_thread = std::thread([this, id, loading_collection, loading_volume,
+                             cache_info, loading_cache_path, needs_decoding,
+                             nb_levels, reduction]() mutable {
+    QString error_title, error_msg;
+    try {
+      if (needs_decoding) {
+        loading_collection->decode(
+            0, loading_volume.get(), &cancel_load,
+            [this, id](int instance) { emit sliceDecoded(id, instance); });
+        // Only complete volumes are cached
+        if (!cancel_load && loading_cache_path != "") {
+          cache_info.min_value = loading_collection->min_value;
+          cache_info.max_value = loading_collection->max_value;
+          QDir().mkpath(QFileInfo(QString::fromStdString(loading_cache_path))
+                            .absolutePath());
+          saveVolumeCache(*loading_volume, cache_info, loading_cache_path);
+        }
+      }
+      // Missing instances only leave their layers unready, which the
+      // pyramid leaves out
+      if (!cancel_load)
+        loaded_pyramid = std::make_shared<VolumePyramid<VolumicData::Voxel>>(
+            loading_volume, nb_levels, reduction);
+    } catch (const DicomCollectionError &error) {
+      error_title = error.title.c_str();
+      error_msg = error.what();
+    } catch (const std::exception &error) {
+      // Such as running out of memory while building the pyramid
+      error_title = "Loading failed";
+      error_msg = error.what();
+    }
+    emit loadFinished(id, error_title, error_msg);
+  });
+  if (from_cache)
+    statusBar()->showMessage("Loaded from cache: " +
+                             QString::fromStdString(cache_path));
+  else
+    statusBar()->showMessage("Loading slices...");
+}
+
+void DicomViewer::cancelLoad() {
+  if (!load_thread.joinable())
+    return;
+  cancel_load = true;
+  load_thread.join();
+}
+
+void DicomViewer::onSliceDecoded(int slice_load_id, int instance) {
+  if (slice_load_id != load_id)
+    return;
+  if (instance == slice_slider->value())
+    updateImage();
+  if (!refresh_timer->isActive())
+    refresh_timer->start();
+  std::ostringstream msg_oss;
+  msg_oss << "Loading slices: " << volume->getNbReadyLayers() << "/"
+          << collection->slices.size();
+  statusBar()->showMessage(msg_oss.str().c_str());
+}
+
+void DicomViewer::onLoadFinished(int finished_load_id, QString error_title,
+                                 QString error_msg) {
+  if (finished_load_id != load_id)
+    return;
+  if (load_thread.joinable())
+    load_thread.join();
+  collection_min_value = collection->min_value;
+  collection_max_value = collection->max_value;
+  gl_widget->setPyramid(std::move(loaded_pyramid));
+  if (!error_msg.isEmpty())
+    QMessageBox::critical(this, error_title, error_msg);
+  if (!from_cache) {
+    std::ostringstream msg_oss;
+    msg_oss << (cancel_load ? "Loading cancelled: " : "Loaded: ")
+            << volume->getNbReadyLayers() << "/" << collection->slices.size()
+            << " slices";
+    statusBar()->showMessage(msg_oss.str().c_str());
+  }
+  // Collection min and max are only known once decoding is over
+  updateWindowSliders();
+  refresh_timer->stop();
+  refreshVolume();
+}
+
+void DicomViewer::refreshVolume() {
+  gl_widget->updateDisplayPoints();
+  gl_widget->update();
 }
 
 void DicomViewer::save() {
@@ -273,13 +379,37 @@ void DicomViewer::showStats() {
   std::string html_endl("<br>");
   std::ostringstream msg_oss;
   msg_oss << "<h1>Collection Properties</h1>";
-  msg_oss << "Patient: " << patient_name << html_endl;
-  msg_oss << "Nb loaded slices: " << active_files.size() << html_endl;
-  msg_oss << "Values used: [" << collection_min << "," << collection_max << "]"
-          << html_endl;
-  msg_oss << "Pixel size: " << pixel_width << "*" << pixel_height << " [mm]"
-          << html_endl;
-  msg_oss << "Slices spacing: " << slice_spacing << " [mm]" << html_endl;
+  if (collection) {
+    double collection_min, collection_max;
+    getCollectionMinMax(&collection_min, &collection_max);
+    msg_oss << "Patient: " << collection->patient_name << html_endl;
+    msg_oss << "Nb slices: " << collection->slices.size() << html_endl;
+    msg_oss << "Nb loaded slices: " << volume->getNbReadyLayers() << html_endl;
+    msg_oss << "Values used: [" << collection_min << "," << collection_max
+            << "]" << html_endl;
+    Histogram histogram = volume->getVolumeHistogram();
+    if (!histogram.isEmpty()) {
+      msg_oss << "Mean: " << histogram.getMean() << " (std "
+              << histogram.getStd() << ")" << html_endl;
+      msg_oss << "Percentiles 1/50/99: [" << histogram.getPercentile(1)
+              << ", " << histogram.getPercentile(50) << ", "
+              << histogram.getPercentile(99) << "]" << html_endl;
+    }
+    // Derived from the histogram of the loaded slices for the window and the
+    // color mode of the 3D view, segment 0 holding the voxels which are not
+    // extracted
+    std::vector<size_t> segment_counts = gl_widget->getSegmentCounts();
+    for (size_t segment = 1; segment < segment_counts.size(); segment++)
+      if (segment_counts[segment] > 0)
+        msg_oss << "Voxels in segment " << segment << ": "
+                << segment_counts[segment] << html_endl;
+    msg_oss << "Pixel size: " << collection->pixel_width << "*"
+            << collection->pixel_height << " [mm]" << html_endl;
+    msg_oss << "Slices spacing: " << collection->slice_spacing << " [mm]"
+            << html_endl;
+  } else {
+    msg_oss << "No collection loaded" << html_endl;
+  }
   msg_oss << html_endl;
   msg_oss << "<h1>Frame Properties</h1>";
   DcmDataset *ds = getDataset();
@@ -291,15 +421,20 @@ void DicomViewer::showStats() {
     msg_oss << "Original transfer syntax: (" << original_syntax << ") "
             << xfer.getXferName() << html_endl;
 
-    std::vector<double> img_position = getImagePosition(ds);
+    const DicomSliceInfo *info = getSliceInfo();
+    msg_oss << "Frame: " << info->frame << html_endl;
+    // Taken from the slice info since multi-frame files hold one position
+    // per frame
+    const std::vector<double> &img_position = info->position;
     msg_oss << "Image position: [" << img_position[0] << "," << img_position[1]
             << "," << img_position[2] << "]" << html_endl;
 
-    DicomImage *image = getDicomImage();
-    if (image) {
-      msg_oss << "Nb frames: " << image->getFrameCount() << html_endl;
-      msg_oss << "Size: " << image->getWidth() << "*" << image->getHeight()
-              << "*" << image->getDepth() << html_endl;
+    if (getActiveLayer() >= 0) {
+      Sint32 nb_frames(1);
+      ds->findAndGetSint32(DCM_NumberOfFrames, nb_frames);
+      msg_oss << "Nb frames: " << nb_frames << html_endl;
+      msg_oss << "Size: " << volume->width << "*" << volume->height
+              << html_endl;
       double min_used_value, max_used_value, min_allowed_value,
           max_allowed_value;
       getMinMax(&min_used_value, &max_used_value, &min_allowed_value,
@@ -308,6 +443,9 @@ void DicomViewer::showStats() {
               << max_allowed_value << "]" << html_endl;
       msg_oss << "Used values: [" << min_used_value << ", " << max_used_value
               << "]" << html_endl;
+      Histogram histogram = volume->getLayerHistogram(getActiveLayer());
+      msg_oss << "Mean: " << histogram.getMean() << " (std "
+              << histogram.getStd() << ")" << html_endl;
       msg_oss << "Window: [" << getWindowMin() << ", " << getWindowMax() << "]"
               << html_endl;
       msg_oss << "Slope: " << getSlope() << html_endl;
@@ -326,7 +464,6 @@ void DicomViewer::onSliceChange(int new_slice) {
   gl_widget->curr_slice = new_slice;
   gl_widget->updateDisplayPoints();
   gl_widget->update();
-  loadDicomImage();
   updateImage();
 }
 
@@ -350,25 +487,46 @@ void DicomViewer::on2dDisplayStateChange(int state) {
 }
 
 void DicomViewer::on3dDisplayStateChange(int state) {
-  if (state >= 1)
+  if (state >= 1) {
     gl_widget->setVisible(false);
-  else
+  } else {
     gl_widget->setVisible(true);
-
-  updateVolumicData();
+    // The volume is already populated, only the display needs a rebuild
+    refreshVolume();
+  }
 }
 
 DcmDataset *DicomViewer::getDataset() {
   int idx = slice_slider->value();
-  if (active_files.count(idx) == 0)
+  if (!collection || collection->slices.count(idx) == 0)
+    return nullptr;
+  // Files are only available once their slice has been decoded
+  if (!volume->isLayerReady(idx - min_instance))
+    return nullptr;
+  return collection->getDataset(idx);
+}
+
+int DicomViewer::getActiveLayer() {
+  int idx = slice_slider->value();
+  if (!collection || collection->slices.count(idx) == 0)
+    return -1;
+  int layer = idx - min_instance;
+  return volume->isLayerReady(layer) ? layer : -1;
+}
+
+const DicomSliceInfo *DicomViewer::getSliceInfo() {
+  int idx = slice_slider->value();
+  if (!collection || collection->slices.count(idx) == 0)
     return nullptr;
-  return active_files.at(idx)->getDataset();
+  return &collection->slices.at(idx);
 }
 
 void DicomViewer::updateInstanceLimits() {
   min_instance = std::numeric_limits<int>::max();
   max_instance = std::numeric_limits<int>::lowest();
-  for (const auto &entry : active_files) {
+  if (!collection)
+    return;
+  for (const auto &entry : collection->slices) {
     if (entry.first < min_instance)
       min_instance = entry.first;
     if (entry.first > max_instance)
@@ -382,7 +540,7 @@ void DicomViewer::updateSliceSlider() {
 }
 
 void DicomViewer::updateWindowSliders() {
-  if (active_files.size() == 0) {
+  if (!collection) {
     window_center_slider->setVisible(false);
     window_width_slider->setVisible(false);
     return;
@@ -391,142 +549,103 @@ void DicomViewer::updateWindowSliders() {
   window_width_slider->setVisible(true);
   // Choice is made to use collection minMax rather than frame minMax here to
   // make sure the slider is not changing each time we change the active layer
+  double collection_min, collection_max;
+  getCollectionMinMax(&collection_min, &collection_max);
+  // Until the first slices are decoded, the default window is used instead
+  if (collection_min > collection_max) {
+    collection_min = getWindowMin();
+    collection_max = getWindowMax();
+  }
   window_center_slider->setLimits(collection_min, collection_max);
   window_width_slider->setLimits(1.0, collection_max - collection_min);
 }
-void DicomViewer::loadDicomImage() {
-  if (image != nullptr)
-    delete (image);
-  image = loadDicomImage(getDataset());
-}
-
-DicomImage *DicomViewer::loadDicomImage(DcmDataset *dataset) {
-  if (dataset == nullptr) {
-    return nullptr;
-  }
-  // Changing syntax to a common one
-  E_TransferSyntax wished_ts = EXS_LittleEndianExplicit;
-  OFCondition status = dataset->chooseRepresentation(wished_ts, NULL);
-  if (status.bad()) {
-    QMessageBox::critical(this, "Dicom Image failure", status.text());
-    return nullptr;
-  }
-  return new DicomImage(dataset, wished_ts);
-}
-
 void DicomViewer::applyDefaultWindow() {
   window_center_slider->setValue(getWindowCenter());
   window_width_slider->setValue(getWindowWidth());
 }
 
 void DicomViewer::updateImage() {
-  if (image == nullptr) {
+  QImage img = getQImage();
+  if (img.isNull()) {
     img_label->setText("No available image");
     return;
   }
-  // Set window
-  double window_center = window_center_slider->value();
-  double window_width = window_width_slider->value();
-  image->setWindow(window_center, window_width);
-  img_label->setImg(getQImage());
-}
-
-void DicomViewer::updateVolumicData() {
-  // Building a buffer to store each layer data
-  int buffer_size = image->getWidth() * image->getHeight();
-  uint16_t buffer[buffer_size];
-  // Getting default window used
-  //double window_center = window_center_slider->value();
-  //double window_width = window_width_slider->value();
-  // Building a VolumicData object with appropriate dimensions
-  std::unique_ptr<VolumicData> new_data(new VolumicData(image->getWidth(), image->getHeight(), max_instance - min_instance + 1, getWindowMin(), getWindowMax(), getIntercept()));
-
-  for (const auto &entry : active_files) {
-    DicomImage *dicom = loadDicomImage(entry.second->getDataset());
-    //dicom->setWindow(window_center, window_width);
-    dicom->setNoVoiTransformation();
-    int bits_per_pixel = 16;
-    int layer = entry.first;
-    int status = dicom->getOutputData((void *)buffer, 2*buffer_size, bits_per_pixel);
-    delete (dicom);
-    if (!status) {
-      QMessageBox::critical(this, "Failed update volumic data",
-                            "getOutputData failed");
-      continue;
-    }
-
-    new_data->setLayer(buffer, layer - min_instance);
-  }
-  new_data->pixel_width = pixel_width;
-  new_data->pixel_height = pixel_height;
-  new_data->slice_spacing = slice_spacing;
-  gl_widget->updateVolumicData(std::move(new_data));
-  gl_widget->update();
-}
-
-std::string DicomViewer::getPatientName(DcmDataset *ds) {
-  return getField<std::string>(ds, DCM_PatientName);
+  img_label->setImg(img);
 }
 
-DicomImage *DicomViewer::getDicomImage() { return image; }
-
 QImage DicomViewer::getQImage() {
-  DicomImage *dicom = getDicomImage();
-  int bits_per_pixel = 8;
-  unsigned long data_size = dicom->getOutputDataSize(bits_per_pixel);
-  if (img_data)
-    free(img_data);
-  img_data = new unsigned char[data_size];
-  int status =
-      dicom->getOutputData((void *)img_data, data_size, bits_per_pixel);
-  if (!status) {
-    QMessageBox::critical(this, "Fatal error",
-                          "Failed to get output data when getting QImage");
+  int layer = getActiveLayer();
+  if (layer < 0)
     return QImage();
+  double window_center = window_center_slider->value();
+  double window_width = window_width_slider->value();
+  // Linear VOI function from the Dicom standard, as applied by DicomImage
+  double low = window_center - 0.5 - (window_width - 1) / 2;
+  double high = window_center - 0.5 + (window_width - 1) / 2;
+  QImage img(volume->width, volume->height, QImage::Format_Grayscale8);
+  for (int row = 0; row < volume->height; row++) {
+    uchar *line = img.scanLine(row);
+    for (int col = 0; col < volume->width; col++) {
+      double value = volume->getHU(col, row, layer);
+      if (value <= low)
+        line[col] = 0;
+      else if (value > high)
+        line[col] = 255;
+      else
+        line[col] =
+            (uchar)(((value - (window_center - 0.5)) / (window_width - 1) +
+                     0.5) *
+                    255);
+    }
   }
-  int width = dicom->getWidth();
-  int height = dicom->getHeight();
-
-  return QImage(img_data, width, height, QImage::Format_Grayscale8);
-}
-
-std::vector<double> DicomViewer::getPixelSpacing(DcmDataset *dataset) {
-  return getFieldVector<double>(dataset, DcmTagKey(0x28, 0x30), 2);
-}
-
-std::vector<double> DicomViewer::getImagePosition(DcmDataset *dataset) {
-  return getFieldVector<double>(dataset, DcmTagKey(0x20, 0x32), 3);
+  return img;
 }
 
 void DicomViewer::getMinMax(double *min_used_value, double *max_used_value,
                             double *min_allowed_value,
                             double *max_allowed_value) {
-  getDicomImage()->getMinMaxValues(*min_used_value, *max_used_value, 0);
+  Histogram histogram = volume->getLayerHistogram(getActiveLayer());
+  *min_used_value = histogram.getMin();
+  *max_used_value = histogram.getMax();
   if (min_allowed_value != nullptr || max_allowed_value != nullptr) {
-    double tmp_min, tmp_max;
-    getDicomImage()->getMinMaxValues(tmp_min, tmp_max, 1);
+    // Range of the stored values, converted with the modality transform
+    DcmDataset *ds = getDataset();
+    Uint16 bits_stored(16), pixel_representation(0);
+    ds->findAndGetUint16(DCM_BitsStored, bits_stored);
+    ds->findAndGetUint16(DCM_PixelRepresentation, pixel_representation);
+    double nb_values = std::pow(2.0, bits_stored);
+    double stored_min = pixel_representation ? -nb_values / 2 : 0;
+    double stored_max = stored_min + nb_values - 1;
+    double tmp_min = stored_min * getSlope() + getIntercept();
+    double tmp_max = stored_max * getSlope() + getIntercept();
     if (min_allowed_value)
-      *min_allowed_value = tmp_min;
+      *min_allowed_value = std::min(tmp_min, tmp_max);
     if (max_allowed_value)
-      *max_allowed_value = tmp_max;
+      *max_allowed_value = std::max(tmp_min, tmp_max);
   }
 }
 
-void DicomViewer::getFrameMinMax(DicomImage *img, double *min, double *max) {
-  int used_values_mode = 0;
-  img->getMinMaxValues(*min, *max, used_values_mode);
-}
-
 void DicomViewer::getCollectionMinMax(double *min, double *max) {
-  *min = collection_min;
-  *max = collection_max;
+  Histogram histogram = volume->getVolumeHistogram();
+  if (histogram.isEmpty()) {
+    *min = collection_min_value;
+    *max = collection_max_value;
+    return;
+  }
+  *min = histogram.getMin();
+  *max = histogram.getMax();
 }
 
-void DicomViewer::getWindow(double *min_value, double *max_value) {
-  double center(0), width(0);
-  getDicomImage()->getWindow(center, width);
-  *min_value = center - width / 2;
-  *max_value = center + width / 2;
+void DicomViewer::applyAutoWindow() {
+  if (!collection)
+    return;
+  Histogram histogram = volume->getVolumeHistogram();
+  if (histogram.isEmpty())
+    return;
+  double center, width;
+  histogram.getAutoWindow(&center, &width);
+  window_center_slider->setValue(center);
+  window_width_slider->setValue(width);
 }
 
 void DicomViewer::loadJSONdata() {
@@ -537,19 +656,23 @@ void DicomViewer::loadJSONdata() {
 }
 
 double DicomViewer::getSlope() {
-  return getField<double>(getDataset(), DcmTagKey(0x28, 0x1053));
+  const DicomSliceInfo *info = getSliceInfo();
+  return info ? info->slope : 1;
 }
 
 double DicomViewer::getIntercept() {
-  return getField<double>(getDataset(), DcmTagKey(0x28, 0x1052));
+  const DicomSliceInfo *info = getSliceInfo();
+  return info ? info->intercept : 0;
 }
 
 double DicomViewer::getWindowCenter() {
-  return getField<double>(getDataset(), DcmTagKey(0x28, 0x1050));
+  const DicomSliceInfo *info = getSliceInfo();
+  return info ? info->window_center : 0;
 }
 
 double DicomViewer::getWindowWidth() {
-  return getField<double>(getDataset(), DcmTagKey(0x28, 0x1051));
+  const DicomSliceInfo *info = getSliceInfo();
+  return info ? info->window_width : 1;
 }
 
 double DicomViewer::getWindowMin() {
@@ -558,53 +681,3 @@ double DicomViewer::getWindowMin() {
 double DicomViewer::getWindowMax() {
   return getWindowCenter() + getWindowWidth() / 2;
 }
-
-int DicomViewer::getSeriesNumber(DcmDataset *dataset) {
-  return getField<int>(dataset, 0x20, 0x11);
-}
-int DicomViewer::getInstanceNumber(DcmDataset *dataset) {
-  return getField<int>(dataset, 0x20, 0x13);
-}
-int DicomViewer::getAcquisitionNumber(DcmDataset *dataset) {
-  return getField<int>(dataset, 0x20, 0x12);
-}
-
-template <>
-double getField<double>(DcmItem *item, const DcmTagKey &tag_key,
-                        unsigned long pos) {
-  double value;
-  OFCondition status = item->findAndGetFloat64(tag_key, value, pos);
-  if (status.bad())
-    std::cerr << "Error on tag: " << tag_key << " -> " << status.text()
-              << std::endl;
-  return value;
-}
-template <>
-short int getField<short int>(DcmItem *item, const DcmTagKey &tag_key,
-                              unsigned long pos) {
-  short int value;
-  OFCondition status = item->findAndGetSint16(tag_key, value, pos);
-  if (status.bad())
-    std::cerr << "Error on tag: " << tag_key << " -> " << status.text()
-              << std::endl;
-  return value;
-}
-template <>
-int getField<int>(DcmItem *item, const DcmTagKey &tag_key, unsigned long pos) {
-  int value;
-  OFCondition status = item->findAndGetSint32(tag_key, value, pos);
-  if (status.bad())
-    std::cerr << "Error on tag: " << tag_key << " -> " << status.text()
-              << std::endl;
-  return value;
-}
-template <>
-std::string getField<std::string>(DcmItem *item, const DcmTagKey &tag_key,
-                                  unsigned long pos) {
-  OFString value;
-  OFCondition status = item->findAndGetOFStringArray(tag_key, value, pos);
-  if (status.bad())
-    std::cerr << "Error on tag: " << tag_key << " -> " << status.text()
-              << std::endl;
-  return value.c_str();
-}
@@ -3,19 +3,24 @@
 
 #include <QGridLayout>
 #include <QMainWindow>
+#include <QTimer>
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <cstdint>
+#include <thread>
 
 #include <dcmtk/dcmdata/dctk.h>
-#include <dcmtk/dcmimgle/dcmimage.h>
 
 #include "double_slider.h"
 #include "glwidget.h"
 #include "image_label.h"
 #include "int_slider.h"
 #include "checkbox.h"
+#include "dicom_collection.h"
+#include "series_index.h"
+#include "volume_cache.h"
 
 
 class DicomViewer : public QMainWindow {
@@ -26,10 +31,19 @@ public:
   ~DicomViewer();
   QSize sizeHint() const { return QSize(600, 400); }
 
+  /// Load and display the given series, slices headers are taken from the
+  /// series instead of being read again
+  void openDicomSeries(const DicomSeries &series);
+
 public slots:
   void openDicomCollection();
+  /// Index a directory tree and open one of the series it contains
+  void openDicomDirectory();
   void showStats();
   void save();
+  /// Set the window from the histogram of the loaded slices, ignoring the
+  /// most extreme values
+  void applyAutoWindow();
 
   void onSliceChange(int new_slice);
   void onWindowCenterChange(double new_window_center);
@@ -38,6 +52,22 @@ public slots:
   void on2dDisplayStateChange(int state);
   void on3dDisplayStateChange(int state);
 
+  /// Stop the background loading, slices decoded so far are kept
+  void cancelLoad();
+
+signals:
+  /// Emitted from the loading thread each time a slice has been decoded
+  void sliceDecoded(int load_id, int instance);
+  /// Emitted from the loading thread when it stops, 'error_msg' is empty if
+  /// all the slices were decoded successfully
+  void loadFinished(int load_id, QString error_title, QString error_msg);
+
+private slots:
+  void onSliceDecoded(int load_id, int instance);
+  void onLoadFinished(int load_id, QString error_title, QString error_msg);
+  /// Rebuild the 3D display with the slices available so far
+  void refreshVolume();
+
 private:
   QWidget *widget;
   QGridLayout *layout;
@@ -63,41 +93,65 @@ private:
   /// The container for display of volumic data
   GLWidget *gl_widget;
 
-  /// The files loaded by the DicomViewer, indexed by acquisition number
-  std::map<int, std::unique_ptr<DcmFileFormat>> active_files;
+  /// The active collection, its files are filled by the loading thread
+  std::unique_ptr<DicomCollection> collection;
+
+  /// The volume of the active collection, shared with gl_widget and the
+  /// loading thread
+  std::shared_ptr<VolumicData> volume;
+  /// Range of the values of the active collection [HU]
+  /// - The loading thread writes the one of the collection while decoding,
+  ///   it is only copied here once the thread has been joined
+  double collection_min_value;
+  double collection_max_value;
+
+  /// Was the volume of the active collection read from the cache instead of
+  /// being decoded?
+  bool from_cache;
+  /// Levels of detail of the volume, written by the loading thread once all
+  /// the layers are ready and handed to gl_widget once it has been joined
+  std::shared_ptr<const VolumePyramid<VolumicData::Voxel>> loaded_pyramid;
+
+  /// The thread decoding the active collection and building the levels of
+  /// detail of its volume in background
+  std::thread load_thread;
+  /// Set to request the loading thread to stop as soon as possible
+  std::atomic<bool> cancel_load;
+  /// Identifier of the last load started, used to ignore the signals sent
+  /// by a previous loading thread
+  int load_id;
+  /// Throttles the rebuilds of the 3D display while slices are decoded
+  QTimer *refresh_timer;
+
+  /// Where the volume of the active collection is cached once decoded
+  /// - empty if the collection is not cached
+  std::string cache_path;
+  /// Signature of the source files of the active collection
+  uint64_t cache_signature;
 
   /// The lowest instance number among active files
   int min_instance;
   /// The highest instance number among active files
   int max_instance;
 
-  /// The active Dicom image
-  DicomImage *image;
-
-  /// The 8-bits image to be shown on screen
-  uchar *img_data;
-
-  /// The width of a pixel in [mm]
-  /// - negative value if no image is loaded
-  double pixel_width;
-  /// The height of a pixel in [mm]
-  /// - negative value if no image is loaded
-  double pixel_height;
-  /// The space between two consecutive slices [mm]
-  /// - 0 if less than 2 images are loaded
-  double slice_spacing;
-
-  /// The name of the patient the collection concerns
-  std::string patient_name;
-  /// Minimal value used among the whole collection
-  double collection_min;
-  /// Maximal value used among the whole collection
-  double collection_max;
+  /// Is the next collection loaded in memory-lean mode?
+  QAction *memory_lean_action;
+
+  /// Replace the active collection by a scanned 'new_collection' and update
+  /// all the display elements
+  /// - If 'decoded_volume' is provided, it is used as the volume of the
+  ///   collection, otherwise the slices are decoded in background
+  void setCollection(std::unique_ptr<DicomCollection> new_collection,
+                     std::unique_ptr<VolumicData> decoded_volume = nullptr);
 
   /// Retrieve access to the dataset of active slice
-  /// if dataset is not available return nullptr
+  /// if dataset is not available (yet) return nullptr
   DcmDataset *getDataset();
 
+  /// Retrieve the header of the active slice
+  /// if there is no active slice return nullptr
+  const DicomSliceInfo *getSliceInfo();
+
   /// Update min_instance and max_instance based on 'active_files'
   void updateInstanceLimits();
 
@@ -107,56 +161,32 @@ private:
   /// Adjust the size of the window based on file content
   void updateWindowSliders();
 
-  /// Load the DicomImage from the active slice
-  /// If there are no active slice available, set image to nullptr
-  void loadDicomImage();
-
-  /// Retrive the image from the given dataset
-  /// On failure, return nullptr and shows a messagebox
-  DicomImage *loadDicomImage(DcmDataset *dataset);
-
-  /// Import the default parameters from the DicomImage
+  /// Import the default window of the active slice
   void applyDefaultWindow();
 
   /// Update the image based on current status of the object
   void updateImage();
 
-  /// Update the volumic_data element based on active_files
-  void updateVolumicData();
-
   void loadJSONdata();
 
-  /// Retrieve patient name from active file
-  /// return 'FAIL' if no active file is found
-  std::string getPatientName(DcmDataset *dataset);
-
-  /// Retrieve image from active file, converting to appropriate transfer syntax
-  /// return nullptr on failure
-  DicomImage *getDicomImage();
+  /// Index of the layer of the volume showing the active slice
+  /// - return -1 if the active slice is not decoded (yet)
+  int getActiveLayer();
 
-  /// Convert current Dicom Image to a QImage according to actual parameters
+  /// Render the active layer of the volume to a QImage according to actual
+  /// window, return a null image if the layer is not available
   QImage getQImage();
 
-  // Returns a two elements vector with [row_spacing, col_spacing] in mm
-  std::vector<double> getPixelSpacing(DcmDataset *dataset);
-
-  // Returns the position of the first voxel transmitted in a three elements
-  // vector with [x,y,z] in mm
-  std::vector<double> getImagePosition(DcmDataset *dataset);
-
-  /// Extract min (and max) used (and allowed) values
+  /// Extract min (and max) used (and allowed) values of the active slice
+  /// Used values are read from the volume, allowed values are deduced from
+  /// the metadata of the slice
   void getMinMax(double *min_used_value, double *max_used_value,
                  double *min_allowed_value = nullptr,
                  double *max_allowed_value = nullptr);
 
-  /// Fill min and max with the extremum values found in the active layer
-  void getFrameMinMax(DicomImage *img, double *min, double *max);
-
   /// Fill min and max with the extremum values found it all the loaded files
   void getCollectionMinMax(double *min, double *max);
 
-  void getWindow(double *min_value, double *max_value);
-
   double getSlope();
   double getIntercept();
 
@@ -164,40 +194,6 @@ private:
   double getWindowWidth();
   double getWindowMin();
   double getWindowMax();
-
-  int getSeriesNumber(DcmDataset *dataset);
-  int getInstanceNumber(DcmDataset *dataset);
-  int getAcquisitionNumber(DcmDataset *dataset);
 };
 
-template <typename T>
-T getField(DcmItem *item, const DcmTagKey &tag_key, unsigned long pos = 0);
-template <typename T>
-T getField(DcmItem *item, unsigned int g, unsigned int e,
-           unsigned long pos = 0) {
-  return getField<T>(item, DcmTagKey(g, e), pos);
-}
-
-template <>
-double getField<double>(DcmItem *item, const DcmTagKey &tag_key,
-                        unsigned long pos);
-template <>
-short int getField<short int>(DcmItem *item, const DcmTagKey &tag_key,
-                              unsigned long pos);
-template <>
-int getField<int>(DcmItem *item, const DcmTagKey &tag_key, unsigned long pos);
-template <>
-std::string getField<std::string>(DcmItem *item, const DcmTagKey &tag_key,
-                                  unsigned long pos);
-
-template <typename T>
-std::vector<T> getFieldVector(DcmItem *item, const DcmTagKey &tag_key,
-                              int fixed_size) {
-  std::vector<T> result(fixed_size);
-  for (int i = 0; i < fixed_size; i++) {
-    result[i] = getField<T>(item, tag_key, i);
-  }
-  return result;
-}
-
 #endif // DICOM_VIEWER_H
@@ -24,12 +24,13 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 
 
+include(dicom_core.pri)
+
 SOURCES += \
         main.cpp \
         dicom_viewer.cpp \
         image_label.cpp \
         double_slider.cpp \
-        volumic_data.cpp \
         glwidget.cpp \
         int_slider.cpp \
         checkbox.cpp
@@ -38,14 +39,6 @@ HEADERS += \
         dicom_viewer.h \
         image_label.h \
         double_slider.h \
-        volumic_data.h \
         glwidget.h \
         int_slider.h \
         checkbox.h
-
-LIBS += \
-        -ldcmdata \
-        -ldcmimage \
-        -ldcmimgle \
-        -lofstd \
-        -ldcmjpeg
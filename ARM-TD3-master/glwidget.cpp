@@ -12,7 +12,9 @@ using namespace std;
 
 GLWidget::GLWidget(QWidget *parent)
 	: QOpenGLWidget(parent), alpha(0.05), log2_zoom(0),
-	  view_type(ViewType::ORTHO), hide_empty_points(true)
+	  view_type(ViewType::ORTHO), hide_empty_points(true), labels_win_min(0),
+	  labels_win_max(0), labels_color_mode(false), level_points(1),
+	  extracted_levels(1, false), level_nb_points(1, 0), display_level(0)
 {
 	QSizePolicy size_policy;
 	size_policy.setVerticalPolicy(QSizePolicy::MinimumExpanding);
@@ -23,6 +25,9 @@ GLWidget::GLWidget(QWidget *parent)
 	hide_below = false;
 	highlight = false;
   	color_mode = false;
+	pyramid_reduction = PyramidReduction::Max;
+	max_pyramid_levels = 4;
+	point_budget = 1 << 22;
 }
 
 GLWidget::~GLWidget() {}
@@ -87,114 +92,161 @@ void GLWidget::hideLayersAbove(int state){
 }
 
 void GLWidget::saveXYZ() {
+	if (!volumic_data)
+		return;
+	// Always saved at full resolution, the levels of detail only affect the
+	// display
+	std::vector<DrawablePoint> extracted_points;
+	const std::vector<DrawablePoint> *points = &level_points[0];
+	if (!extracted_levels[0] || points->size() != level_nb_points[0])
+	{
+		extracted_points = createExtractor(0).extractPoints(*volumic_data,
+															getLabels(0));
+		points = &extracted_points;
+	}
 	ofstream MyFile("points.xyz");
-	for (const DrawablePoint &p : display_points)
+	for (const DrawablePoint &p : *points)
 	{
 		MyFile << p.pos.x() << " " << p.pos.y() << " " << p.pos.z() << "\n";
 	}
 	MyFile.close();
 }
 
-void GLWidget::updateVolumicData(std::unique_ptr<VolumicData> new_data)
+void GLWidget::updateVolumicData(std::shared_ptr<const VolumicData> new_data)
 {
+	pyramid.reset();
+	level_labels.clear();
 	volumic_data = std::move(new_data);
 	updateDisplayPoints();
 	update();
 }
 
+void GLWidget::setPyramid(
+	std::shared_ptr<const VolumePyramid<VolumicData::Voxel>> new_pyramid)
+{
+	pyramid = std::move(new_pyramid);
+}
+
 void GLWidget::updateDisplayPoints()
 {
-	display_points.clear();
-	if (!volumic_data)
-		return;
-	int W = volumic_data->width;
-	int H = volumic_data->height;
-	int D = volumic_data->depth;
-	int col = 0;
-	int row = 0;
-	int depth = 0;
-	double x_factor = volumic_data->pixel_width;
-	double y_factor = volumic_data->pixel_height;
-	double z_factor = volumic_data->slice_spacing;
-	double max_size =
-		std::max(std::max(x_factor * W, y_factor * H), z_factor * D);
-	double global_factor = 2.0 / max_size;
-	x_factor *= global_factor;
-	y_factor *= global_factor;
-	z_factor *= global_factor;
-	int idx_start = 0;
-	int idx_end = W * H * D;
-	if(!hide_below && !hide_above)
-	{
-		idx_start = 0;
-		idx_end = W * H * D;
-	}
-	else if(hide_below && !hide_above)
-	{
-		idx_start = W * H * (curr_slice-1);
-		idx_end = W * H * D;
-	}
-	else if(!hide_below && hide_above)
+	level_points.clear();
+	extracted_levels.clear();
+	level_nb_points.clear();
+	display_level = 0;
+	int nb_levels = pyramid ? pyramid->getNbLevels() : 1;
+	level_points.resize(nb_levels);
+	extracted_levels.resize(nb_levels, false);
+	level_nb_points.resize(nb_levels, 0);
+	if (volumic_data)
+		selectDisplayLevel();
+}
+
+void GLWidget::selectDisplayLevel()
+{
+	int nb_levels = (int)level_points.size();
+	// Zooming out by a factor 2 halves the size of the voxels on screen
+	int zoom_level = log2_zoom < 0 ? (int)std::floor(-log2_zoom) : 0;
+	display_level = std::min(zoom_level, nb_levels - 1);
+	while (true)
 	{
-		idx_start = 0;
-		idx_end = W * H * (curr_slice);
+		if (!extracted_levels[display_level])
+			extractLevel(display_level);
+		if (level_nb_points[display_level] <= point_budget ||
+			display_level == nb_levels - 1)
+			break;
+		display_level++;
 	}
-	else if(hide_above && hide_below)
+}
+
+std::vector<size_t> GLWidget::getSegmentCounts()
+{
+	std::vector<size_t> counts;
+	if (!volumic_data)
+		return counts;
+	// The segment of a voxel only depends on its value, the histogram has one
+	// bin per value
+	Histogram histogram = volumic_data->getVolumeHistogram();
+	if (histogram.isEmpty())
+		return counts;
+	double win_min, win_max;
+	getWinMinMax(&win_min, &win_max);
+	VoxelClassifier<VolumicData::Voxel> classifier(
+		volumic_data->win_min, volumic_data->win_max, win_min, win_max,
+		color_mode, false);
+	for (int value = histogram.getMin(); value <= histogram.getMax(); value++)
 	{
-		idx_start = W * H * (curr_slice-1);
-		idx_end = W * H * (curr_slice);
+		uint64_t count = histogram.getValueCount(value);
+		if (count == 0)
+			continue;
+		size_t segment = classifier.getSegment((VolumicData::Voxel)value);
+		if (segment >= counts.size())
+			counts.resize(segment + 1, 0);
+		counts[segment] += count;
 	}
+	return counts;
+}
 
-	idx_end = std::min(idx_end, W*H*D);
-	int range = idx_end - idx_start;
-	if(range <= 0)
-		return;
-	display_points.reserve(range);
-
-	double cur_win_min;
-	double cur_win_max;
-	getWinMinMax(&cur_win_min, &cur_win_max);
+const VolumicData &GLWidget::getLevelVolume(int level) const
+{
+	return level == 0 ? *volumic_data : pyramid->getLevel(level);
+}
 
-	// Importing points
-	for (int idx = idx_start; idx < idx_end; idx++)
+const LabelVolume &GLWidget::getLabels(int level)
+{
+	double win_min, win_max;
+	getWinMinMax(&win_min, &win_max);
+	if (win_min != labels_win_min || win_max != labels_win_max ||
+		color_mode != labels_color_mode)
 	{
-		double raw_color = volumic_data->data[idx];
-		double c = volumic_data->manualWindowHandling(raw_color); // c [0;1]
-
-		if (c > 0 || !hide_empty_points)
-		{
-			int segment = volumic_data->threshold(raw_color, cur_win_min, cur_win_max, color_mode);
-
-			if (segment != 0)
-			{
-				if (!contours_mode || (contours_mode && connectivity(color_mode ? 0 : 2, idx, segment, cur_win_min, cur_win_max)))
-				{
-					DrawablePoint p;
-					p.a = alpha;
-					if(highlight){
-      					if(idx>=(curr_slice-1)*W*H && idx<(curr_slice)*W*H)
-            				p.a = 1.0;   
-    				}
-					p.color = volumic_data->getColorSegment(segment, c);
-
-					p.pos = QVector3D((col - W / 2.) * x_factor, (row - H / 2.) * y_factor, (depth - D / 2.) * z_factor);
-					display_points.push_back(p);
-				}
-			}
-		}
-		col++;
-		if (col == W)
-		{
-			row++;
-			col = 0;
-		}
-		if (row == H)
-		{
-			depth++;
-			row = 0;
-		}
+		level_labels.clear();
+		labels_win_min = win_min;
+		labels_win_max = win_max;
+		labels_color_mode = color_mode;
 	}
-	std::cout << "Nb points: " << display_points.size() << std::endl;
+	level_labels.resize(pyramid ? pyramid->getNbLevels() : 1);
+	const VolumicData &volume = getLevelVolume(level);
+	std::unique_ptr<LabelVolume> &labels = level_labels[level];
+	if (labels && !labels->isOutdated(volume))
+		return *labels;
+	// The segments only depend on the window and on the color mode
+	VoxelClassifier<VolumicData::Voxel> classifier(
+		volume.win_min, volume.win_max, win_min, win_max, color_mode, false);
+	if (labels)
+		labels->update(volume, classifier);
+	else
+		labels.reset(new LabelVolume(volume, classifier, 0, volume.depth));
+	return *labels;
+}
+
+PointExtractor GLWidget::createExtractor(int level)
+{
+	PointExtractor extractor;
+	getWinMinMax(&extractor.threshold_min, &extractor.threshold_max);
+	extractor.contours_mode = contours_mode;
+	extractor.color_mode = color_mode;
+	extractor.hide_below = hide_below;
+	extractor.hide_above = hide_above;
+	extractor.highlight = highlight;
+	// Each level halves the number of layers
+	extractor.active_slice = ((curr_slice - 1) >> level) + 1;
+	extractor.alpha = alpha;
+	extractor.hide_empty_points = hide_empty_points;
+	return extractor;
+}
+
+void GLWidget::extractLevel(int level)
+{
+	// Extracted on all the cores, in the same order as a sequential extraction
+	std::vector<DrawablePoint> &points = level_points[level];
+	points = createExtractor(level).extractPoints(getLevelVolume(level),
+												  getLabels(level));
+	extracted_levels[level] = true;
+	level_nb_points[level] = points.size();
+	std::cout << "Nb points: " << points.size() << " (level " << level << ")"
+			  << std::endl;
+	// Only the number of points of a level over the budget is needed
+	if (points.size() > point_budget && level < (int)level_points.size() - 1)
+		std::vector<DrawablePoint>().swap(points);
 }
 
 void GLWidget::initializeGL()
@@ -247,7 +299,7 @@ void GLWidget::paintGL()
 	glLoadIdentity();
 
 	glBegin(GL_POINTS);
-	for (const DrawablePoint &p : display_points)
+	for (const DrawablePoint &p : level_points[display_level])
 	{
 		if(highlight && p.a == 1.0)
       		glColor4f(p.color.x(), p.color.y(), p.color.z(), p.a);
@@ -288,6 +340,8 @@ void GLWidget::wheelEvent(QWheelEvent *event)
 {
 	double delta = modifiedDelta(event->delta() / 1000.0);
 	log2_zoom += delta;
+	if (volumic_data)
+		selectDisplayLevel();
 	update();
 }
 
@@ -314,57 +368,6 @@ void GLWidget::setWinWidth(double new_value)
 	update();
 }
 
-bool GLWidget::connectivity(const int mode, const int idx, const int curr_segment, const double min, const double max)
-{
-	const int W = volumic_data->width;
-	const int H = volumic_data->height;
-	const int D = volumic_data->depth;
-
-	const QVector3D pos = volumic_data->getCoordinate(idx);
-	
-	const int x = pos.x();
-	const int y = pos.y();
-	const int z = pos.z();
-
-	for (int dz = -1; dz <= 1; ++dz)
-		for (int dy = -1; dy <= 1; ++dy)
-			for (int dx = -1; dx <= 1; ++dx)
-			{
-				int new_x = x + dx;
-				int new_y = y + dy;
-				int new_z = z + dz;
-
-				if(new_x < 0 || new_y < 0 || new_z < 0 || new_x >= W || new_y >= H || new_z >= D)
-					continue;
-
-				switch(mode)
-				{
-					case 0:
-					{
-						if(!(abs(dx+dy+dz) == 1 && (dx == 0 || dy == 0 || dz == 0)))
-							continue;
-						break;
-					}
-					case 1:
-					{
-						if(dx != 0 && dy != 0 && dz != 0)
-							continue;
-						break;
-					}
-					case 2: break;
-					default: break;
-				}	
-
-				double raw_color = volumic_data->getValue(new_x, new_y, new_z);
-				int neighbor_segment = volumic_data->threshold(raw_color, min, max, color_mode);
-				if (curr_segment != neighbor_segment) {
-					return true;
-				}
-			}
-
-	return false;
-}
-
 void GLWidget::getWinMinMax(double* min, double* max) {
 	if(min)
 		*min = win_center - (win_width / 2);
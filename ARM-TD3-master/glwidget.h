@@ -7,6 +7,8 @@
 
 #include <memory>
 
+#include "point_extractor.h"
+#include "volume_pyramid.h"
 #include "volumic_data.h"
 
 class GLWidget : public QOpenGLWidget {
@@ -21,13 +23,25 @@ public:
 
   float getAlpha() const;
 
-  void updateVolumicData(std::unique_ptr<VolumicData> new_data);
+  /// Display 'new_data', without levels of detail until setPyramid is called
+  void updateVolumicData(std::shared_ptr<const VolumicData> new_data);
+  /// Use the levels of detail 'new_pyramid' of the displayed volume, built
+  /// by the loading thread once all its layers are ready
+  /// - Only used by the next call to updateDisplayPoints
+  void setPyramid(
+      std::shared_ptr<const VolumePyramid<VolumicData::Voxel>> new_pyramid);
 
   void setWinCenter(double new_value);
   void setWinWidth(double new_value);
 
   void updateDisplayPoints();
 
+  /// Number of voxels of each segment in the ready layers of the full
+  /// resolution volume for the current window and color mode, indexed by
+  /// segment
+  /// - Derived from the histogram of the volume, without labelling it
+  std::vector<size_t> getSegmentCounts();
+
   bool contours_mode;
   bool highlight;
   bool hide_below;
@@ -35,6 +49,14 @@ public:
   int curr_slice;
   bool color_mode;
 
+  /// Reduction used by the loading thread to build the levels of detail
+  PyramidReduction pyramid_reduction;
+  /// Maximal number of levels of detail, including the full resolution
+  int max_pyramid_levels;
+  /// Maximal number of points drawn, a coarser level of detail is drawn
+  /// when a level has more points
+  size_t point_budget;
+
 public slots:
   void setAlpha(double new_alpha);
   void onContoursModeChange(int state);
@@ -45,12 +67,6 @@ public slots:
   void saveXYZ();
 
 protected:
-  struct DrawablePoint {
-    QVector3D pos;
-    QVector3D color;
-    double a;
-  };
-
   void initializeGL() override;
   void paintGL() override;
 
@@ -65,9 +81,25 @@ protected:
    */
   double modifiedDelta(double delta);
 
-  bool connectivity(const int mode, const int idx, const int curr_segment, const double min, const double max);
   void getWinMinMax(double* min, double* max);
 
+  /// Display the finest level allowed by the zoom whose number of points is
+  /// within the point budget, the coarsest level if none of them is
+  /// - The levels are extracted from the finest one until one fits in the
+  ///   budget, their number of points is kept with the current settings
+  void selectDisplayLevel();
+  /// Extractor of the points of 'level' with the current settings
+  PointExtractor createExtractor(int level);
+  /// Extract the points of 'level', they are only kept in level_points if
+  /// they fit in the point budget or if it is the coarsest level
+  void extractLevel(int level);
+  /// Volume of 'level', 0 being volumic_data
+  const VolumicData &getLevelVolume(int level) const;
+  /// Segment labels of 'level' for the current window and color mode, they
+  /// are only computed again when one of them changes, or for the layers
+  /// loaded since the previous call
+  const LabelVolume &getLabels(int level);
+
   QPoint lastPos;
   float alpha;
   /**
@@ -86,11 +118,31 @@ protected:
   /// When enabled, all points with a drawing color = 0 are hidden
   bool hide_empty_points;
 
-  /// The data of all the slices stored in a single object
-  std::unique_ptr<VolumicData> volumic_data;
-
-  /// The points to be drawn
-  std::vector<DrawablePoint> display_points;
+  /// The data of all the slices stored in a single object, shared with the
+  /// viewer which fills it
+  std::shared_ptr<const VolumicData> volumic_data;
+
+  /// Levels of detail of volumic_data, only available once all the layers
+  /// are ready
+  std::shared_ptr<const VolumePyramid<VolumicData::Voxel>> pyramid;
+
+  /// Segment labels of the levels of detail, empty for the levels which have
+  /// not been labelled
+  std::vector<std::unique_ptr<LabelVolume>> level_labels;
+  /// The window [HU] and the color mode level_labels were computed for
+  double labels_win_min;
+  double labels_win_max;
+  bool labels_color_mode;
+
+  /// The points extracted from each level of detail with the current
+  /// settings, so that zooming switches between levels instantly
+  std::vector<std::vector<DrawablePoint>> level_points;
+  std::vector<bool> extracted_levels;
+  /// Number of points of each extracted level, including the ones whose
+  /// points exceeded the budget and were not kept
+  std::vector<size_t> level_nb_points;
+  /// The level whose points are drawn
+  int display_level;
   
 };
 
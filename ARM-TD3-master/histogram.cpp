@@ -0,0 +1,132 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+Histogram::Histogram() : first_value(0), nb_values(0) {}
+
+void Histogram::add(const int16_t *values, size_t nb_new_values) {
+  if (nb_new_values == 0)
+    return;
+  // Written as a plain loop so that the compiler vectorizes it
+  int16_t min = values[0];
+  int16_t max = values[0];
+  for (size_t i = 1; i < nb_new_values; i++) {
+    min = std::min(min, values[i]);
+    max = std::max(max, values[i]);
+  }
+  extend(min, max);
+  uint64_t *bins = counts.data() - first_value;
+  for (size_t i = 0; i < nb_new_values; i++)
+    bins[values[i]]++;
+  nb_values += nb_new_values;
+}
+
+void Histogram::merge(const Histogram &other) {
+  if (other.isEmpty())
+    return;
+  extend(other.getMin(), other.getMax());
+  size_t offset = other.first_value - first_value;
+  for (size_t bin = 0; bin < other.counts.size(); bin++)
+    counts[offset + bin] += other.counts[bin];
+  nb_values += other.nb_values;
+}
+
+void Histogram::subtract(const Histogram &other) {
+  if (other.isEmpty())
+    return;
+  if (other.getMin() < first_value || other.getMax() > getMax() ||
+      other.nb_values > nb_values)
+    throw std::logic_error("Histogram::subtract: values were not counted");
+  size_t offset = other.first_value - first_value;
+  for (size_t bin = 0; bin < other.counts.size(); bin++)
+    counts[offset + bin] -= other.counts[bin];
+  nb_values -= other.nb_values;
+  trim();
+}
+
+bool Histogram::isEmpty() const { return nb_values == 0; }
+
+uint64_t Histogram::getCount() const { return nb_values; }
+
+uint64_t Histogram::getValueCount(int value) const {
+  if (value < first_value || value > getMax())
+    return 0;
+  return counts[value - first_value];
+}
+
+int Histogram::getMin() const { return first_value; }
+
+int Histogram::getMax() const {
+  return first_value + (int)counts.size() - 1;
+}
+
+double Histogram::getMean() const {
+  double sum = 0;
+  for (size_t bin = 0; bin < counts.size(); bin++)
+    sum += (double)counts[bin] * (first_value + (int)bin);
+  return sum / nb_values;
+}
+
+double Histogram::getStd() const {
+  double mean = getMean();
+  double sum_sq = 0;
+  for (size_t bin = 0; bin < counts.size(); bin++) {
+    double delta = first_value + (int)bin - mean;
+    sum_sq += counts[bin] * delta * delta;
+  }
+  return std::sqrt(sum_sq / nb_values);
+}
+
+int Histogram::getPercentile(double percent) const {
+  double target = std::ceil(percent / 100 * nb_values);
+  uint64_t cumulated = 0;
+  for (size_t bin = 0; bin < counts.size(); bin++) {
+    cumulated += counts[bin];
+    if (cumulated > 0 && cumulated >= target)
+      return first_value + (int)bin;
+  }
+  return getMax();
+}
+
+void Histogram::getAutoWindow(double *center, double *width,
+                              double low_percent, double high_percent) const {
+  int low = getPercentile(low_percent);
+  int high = getPercentile(high_percent);
+  *center = (low + high) / 2.0;
+  *width = std::max(1, high - low);
+}
+
+void Histogram::extend(int min, int max) {
+  if (counts.empty()) {
+    first_value = min;
+    counts.assign(max - min + 1, 0);
+    return;
+  }
+  int new_first = std::min(min, first_value);
+  int new_last = std::max(max, getMax());
+  if (new_first == first_value && new_last == getMax())
+    return;
+  std::vector<uint64_t> new_counts(new_last - new_first + 1, 0);
+  std::copy(counts.begin(), counts.end(),
+            new_counts.begin() + (first_value - new_first));
+  counts.swap(new_counts);
+  first_value = new_first;
+}
+
+void Histogram::trim() {
+  if (nb_values == 0) {
+    counts.clear();
+    first_value = 0;
+    return;
+  }
+  size_t begin = 0;
+  while (counts[begin] == 0)
+    begin++;
+  size_t end = counts.size();
+  while (counts[end - 1] == 0)
+    end--;
+  counts = std::vector<uint64_t>(counts.begin() + begin, counts.begin() + end);
+  first_value += begin;
+}
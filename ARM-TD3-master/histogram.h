@@ -0,0 +1,55 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Exact histogram of 16-bit values, with one bin per value
+///
+/// Bins only cover the range of the values counted, so that the histogram of
+/// a CT slice uses a few thousand bins. All the queries are in O(bins).
+class Histogram {
+public:
+  Histogram();
+
+  /// Count the 'nb_values' values at 'values'
+  void add(const int16_t *values, size_t nb_values);
+  /// Add or remove the values counted by 'other'
+  void merge(const Histogram &other);
+  void subtract(const Histogram &other);
+
+  bool isEmpty() const;
+  /// Number of values counted
+  uint64_t getCount() const;
+  /// Number of occurrences of 'value'
+  uint64_t getValueCount(int value) const;
+  /// Range of the values counted, only valid if the histogram is not empty
+  int getMin() const;
+  int getMax() const;
+  double getMean() const;
+  /// Standard deviation
+  double getStd() const;
+  /// Lowest value such that at least 'percent' % of the values are lower or
+  /// equal to it
+  int getPercentile(double percent) const;
+  /// Window covering the values between the 'low_percent' and
+  /// 'high_percent' percentiles, so that a few extreme values (air, metal)
+  /// do not squeeze the contrast
+  void getAutoWindow(double *center, double *width, double low_percent = 0.5,
+                     double high_percent = 99.5) const;
+
+private:
+  /// Value counted by counts[0]
+  int first_value;
+  /// Number of occurrences of each value
+  std::vector<uint64_t> counts;
+  uint64_t nb_values;
+
+  /// Grow the bins to include [min, max]
+  void extend(int min, int max);
+  /// Remove the empty bins at both ends
+  void trim();
+};
+
+#endif // HISTOGRAM_H
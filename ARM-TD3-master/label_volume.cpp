@@ -0,0 +1,171 @@
+#include "label_volume.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "parallel.h"
+
+// SSE2 is part of x86-64, the rows are compared one label at a time on
+// other targets
+#if defined(__SSE2__)
+#define LABEL_SSE2_KERNEL
+#include <emmintrin.h>
+#endif
+
+namespace {
+/// Is the voxel at (dx, dy, dz) from the center of a 3x3x3 neighbourhood one
+/// of its 'neighbourhood' (6, 18 or 26) neighbours?
+constexpr bool isNeighbour(int neighbourhood, int dx, int dy, int dz) {
+  return (dx != 0) + (dy != 0) + (dz != 0) > 0 &&
+         (dx != 0) + (dy != 0) + (dz != 0) <=
+             (neighbourhood == 6 ? 1 : neighbourhood == 18 ? 2 : 3);
+}
+
+/// Set flags[col] to 1 if center[col] differs from neighbours[n][col] for
+/// any of the 'Neighbourhood' rows, to 0 otherwise, for col in [0, width)
+template <int Neighbourhood>
+void compareRows(const uint8_t *center, const uint8_t *const *neighbours,
+                 int width, uint8_t *flags) {
+  int col = 0;
+#ifdef LABEL_SSE2_KERNEL
+  const __m128i ones = _mm_set1_epi8(1);
+  for (; col + 16 <= width; col += 16) {
+    __m128i labels = _mm_loadu_si128((const __m128i *)(center + col));
+    __m128i same = _mm_set1_epi8(-1);
+    for (int n = 0; n < Neighbourhood; n++)
+      same = _mm_and_si128(
+          same, _mm_cmpeq_epi8(labels, _mm_loadu_si128((const __m128i *)(
+                                           neighbours[n] + col))));
+    _mm_storeu_si128((__m128i *)(flags + col), _mm_andnot_si128(same, ones));
+  }
+#endif
+  for (; col < width; col++) {
+    bool outside_segment = false;
+    for (int n = 0; n < Neighbourhood; n++)
+      outside_segment |= neighbours[n][col] != center[col];
+    flags[col] = outside_segment;
+  }
+}
+} // namespace
+
+template <typename T>
+LabelVolume::LabelVolume(const BasicVolumicData<T> &volume,
+                         const VoxelClassifier<T> &classifier,
+                         int first_layer, int depth, int nb_threads)
+    : width(volume.width), height(volume.height), first_layer(first_layer),
+      depth(depth), row_stride(volume.width + 2),
+      labels(row_stride * volume.height * std::max(depth, 0)),
+      final_layers(std::max(depth, 0), 0) {
+  std::vector<int> layers(std::max(depth, 0));
+  for (int z = 0; z < depth; z++)
+    layers[z] = z;
+  labelLayers(volume, classifier, layers, nb_threads);
+}
+
+template <typename T>
+bool LabelVolume::isOutdated(const BasicVolumicData<T> &volume) const {
+  for (int z = 0; z < depth; z++)
+    if (!final_layers[z] && volume.isLayerReady(first_layer + z))
+      return true;
+  return false;
+}
+
+template <typename T>
+void LabelVolume::update(const BasicVolumicData<T> &volume,
+                         const VoxelClassifier<T> &classifier,
+                         int nb_threads) {
+  std::vector<int> layers;
+  for (int z = 0; z < depth; z++)
+    if (!final_layers[z] && volume.isLayerReady(first_layer + z))
+      layers.push_back(z);
+  labelLayers(volume, classifier, layers, nb_threads);
+}
+
+template <typename T>
+void LabelVolume::labelLayers(const BasicVolumicData<T> &volume,
+                              const VoxelClassifier<T> &classifier,
+                              const std::vector<int> &layers,
+                              int nb_threads) {
+  parallelFor(
+      0, layers.size(),
+      [&](size_t idx) {
+        int z = layers[idx];
+        // Checked before reading the voxels, which are final once the layer
+        // is ready. The others keep the segment 0 until update labels them
+        if (!volume.isLayerReady(first_layer + z))
+          return;
+        final_layers[z] = 1;
+        const T *layer = volume.getLayerData(first_layer + z);
+        for (int row = 0; row < height; row++) {
+          const T *voxels = layer + (size_t)width * row;
+          uint8_t *row_labels =
+              &labels[row_stride * (row + (size_t)height * z) + 1];
+          for (int col = 0; col < width; col++)
+            row_labels[col] = classifier.getSegment(voxels[col]);
+          row_labels[-1] = row_labels[0];
+          row_labels[width] = row_labels[width - 1];
+        }
+      },
+      nb_threads);
+}
+
+void LabelVolume::findBoundary(int layer, int neighbourhood,
+                               uint8_t *boundary) const {
+  int z = layer - first_layer;
+  switch (neighbourhood) {
+  case 6:
+    findBoundaryRows<6>(z, boundary);
+    break;
+  case 18:
+    findBoundaryRows<18>(z, boundary);
+    break;
+  case 26:
+    findBoundaryRows<26>(z, boundary);
+    break;
+  default:
+    throw std::invalid_argument(
+        "LabelVolume::findBoundary: neighbourhood must be 6, 18 or 26");
+  }
+}
+
+template <int Neighbourhood>
+void LabelVolume::findBoundaryRows(int z, uint8_t *boundary) const {
+  const uint8_t *neighbours[Neighbourhood];
+  for (int row = 0; row < height; row++) {
+    // The neighbour rows outside of the labelled layers are clamped to them
+    int n = 0;
+    for (int dz = -1; dz <= 1; dz++) {
+      int neighbour_z = std::min(std::max(z + dz, 0), depth - 1);
+      for (int dy = -1; dy <= 1; dy++) {
+        int neighbour_row = std::min(std::max(row + dy, 0), height - 1);
+        for (int dx = -1; dx <= 1; dx++)
+          if (isNeighbour(Neighbourhood, dx, dy, dz))
+            neighbours[n++] = getRow(neighbour_row, neighbour_z) + dx;
+      }
+    }
+    compareRows<Neighbourhood>(getRow(row, z), neighbours, width,
+                               boundary + (size_t)width * row);
+  }
+}
+
+template LabelVolume::LabelVolume(const BasicVolumicData<int16_t> &,
+                                  const VoxelClassifier<int16_t> &, int, int,
+                                  int);
+template LabelVolume::LabelVolume(const BasicVolumicData<uint8_t> &,
+                                  const VoxelClassifier<uint8_t> &, int, int,
+                                  int);
+template LabelVolume::LabelVolume(const BasicVolumicData<float> &,
+                                  const VoxelClassifier<float> &, int, int,
+                                  int);
+template bool
+LabelVolume::isOutdated(const BasicVolumicData<int16_t> &) const;
+template void LabelVolume::update(const BasicVolumicData<int16_t> &,
+                                  const VoxelClassifier<int16_t> &, int);
+template bool
+LabelVolume::isOutdated(const BasicVolumicData<uint8_t> &) const;
+template void LabelVolume::update(const BasicVolumicData<uint8_t> &,
+                                  const VoxelClassifier<uint8_t> &, int);
+template bool
+LabelVolume::isOutdated(const BasicVolumicData<float> &) const;
+template void LabelVolume::update(const BasicVolumicData<float> &,
+                                  const VoxelClassifier<float> &, int);
@@ -0,0 +1,87 @@
+#ifndef LABEL_VOLUME_H
+#define LABEL_VOLUME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "volumic_data.h"
+#include "voxel_classifier.h"
+
+/// The segment of each voxel of some layers of a volume, one byte per voxel
+///
+/// Contours are found on the labels by comparing whole rows with their
+/// shifted neighbour rows, 16 voxels at a time. Each row is stored with one
+/// extra label at both ends, copied from its first and last voxel, and the
+/// neighbour rows outside of the layers are clamped to them, so that no
+/// voxel is bounds checked. A neighbour clamped to the layers is still in the
+/// neighbourhood of the voxel, the contours are then the same as when the
+/// neighbours outside of the layers are ignored.
+class LabelVolume {
+public:
+  int width;
+  int height;
+  /// The labelled layers of the source volume are
+  /// [first_layer, first_layer + depth)
+  int first_layer;
+  int depth;
+
+  /// Label the layers [first_layer, first_layer + depth) of 'volume' with
+  /// the segment 'classifier' gives to their voxels, on 'nb_threads' threads
+  /// (one per core if <= 0)
+  /// - Only the ready layers are labelled, the voxels of the others are in
+  ///   segment 0 until update is called once they are ready
+  /// Instantiated for all the voxel types of BasicVolumicData
+  template <typename T>
+  LabelVolume(const BasicVolumicData<T> &volume,
+              const VoxelClassifier<T> &classifier, int first_layer,
+              int depth, int nb_threads = 0);
+
+  /// Have layers of 'volume' become ready since they were labelled?
+  template <typename T>
+  bool isOutdated(const BasicVolumicData<T> &volume) const;
+  /// Label again the layers of 'volume' which have become ready since they
+  /// were labelled, with the same settings of 'classifier' as the first time
+  template <typename T>
+  void update(const BasicVolumicData<T> &volume,
+              const VoxelClassifier<T> &classifier, int nb_threads = 0);
+
+  /// Segment of the voxel at (col, row, layer), 'layer' being a layer of
+  /// the source volume
+  inline uint8_t getLabel(int col, int row, int layer) const {
+    return getRow(row, layer - first_layer)[col];
+  }
+
+  /// Set to 1 the flags of the voxels of 'layer' which have one of their
+  /// 'neighbourhood' (6, 18 or 26) neighbours in another segment, and to 0
+  /// the ones of the other voxels
+  /// - 'layer' is a layer of the source volume, 'boundary' receives
+  ///   width*height flags, row by row
+  /// - Throws std::invalid_argument if 'neighbourhood' is not valid
+  void findBoundary(int layer, int neighbourhood, uint8_t *boundary) const;
+
+private:
+  /// Labels of a row, including the extra one at each end
+  size_t row_stride;
+  std::vector<uint8_t> labels;
+  /// Flags of the labelled layers, whose source layer was ready and which
+  /// are never labelled again
+  std::vector<uint8_t> final_layers;
+
+  /// First label of 'row' in the labelled layer 'z'
+  inline const uint8_t *getRow(int row, int z) const {
+    return labels.data() + row_stride * (row + (size_t)height * z) + 1;
+  }
+
+  /// Label the layers 'layers' of the labelled ones which are ready in
+  /// 'volume', skipping the others
+  template <typename T>
+  void labelLayers(const BasicVolumicData<T> &volume,
+                   const VoxelClassifier<T> &classifier,
+                   const std::vector<int> &layers, int nb_threads);
+
+  template <int Neighbourhood>
+  void findBoundaryRows(int z, uint8_t *boundary) const;
+};
+
+#endif // LABEL_VOLUME_H
@@ -0,0 +1,128 @@
+// Check that volumes with more than 2^31 voxels are addressed with 64-bit
+// indices
+//
+// A windowed volume of 1024x1024x2100 voxels (2.2 GB) is filled with a small
+// cube of extracted voxels placed beyond voxel 2^31. The points extracted
+// from it, with and without contours, must be exactly the ones of the cube.
+// Exits with a non-zero status if any check fails.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "point_extractor.h"
+#include "volumic_data.h"
+
+namespace {
+const int width = 1024;
+const int height = 1024;
+const int depth = 2100;
+/// The extracted cube is [cube_begin, cube_begin + cube_size) along each
+/// axis, its first voxel being beyond 2^31
+const int cube_size = 4;
+const int cube_begin[3] = {1010, 1000, 2090};
+
+bool isInCube(int col, int row, int layer) {
+  int coords[3] = {col, row, layer};
+  for (int axis = 0; axis < 3; axis++)
+    if (coords[axis] < cube_begin[axis] ||
+        coords[axis] >= cube_begin[axis] + cube_size)
+      return false;
+  return true;
+}
+
+/// Is (col, row, layer) on the boundary of the cube, i.e. does it have one
+/// of its 26 neighbours outside of it?
+bool isOnCubeBoundary(int col, int row, int layer) {
+  for (int dz = -1; dz <= 1; dz++)
+    for (int dy = -1; dy <= 1; dy++)
+      for (int dx = -1; dx <= 1; dx++)
+        if (!isInCube(col + dx, row + dy, layer + dz))
+          return true;
+  return false;
+}
+
+/// Positions of the points expected from 'volume', in storage order
+std::vector<QVector3D> getExpectedPositions(const WindowedVolumicData &volume,
+                                            bool contours_mode) {
+  // Same scaling as PointExtractor: centered and fitted in [-1,1]
+  double factor = 2.0 / std::max(std::max(volume.pixel_width * width,
+                                          volume.pixel_height * height),
+                                 volume.slice_spacing * depth);
+  std::vector<QVector3D> positions;
+  for (int layer = cube_begin[2]; layer < cube_begin[2] + cube_size; layer++)
+    for (int row = cube_begin[1]; row < cube_begin[1] + cube_size; row++)
+      for (int col = cube_begin[0]; col < cube_begin[0] + cube_size; col++)
+        if (!contours_mode || isOnCubeBoundary(col, row, layer))
+          positions.push_back(QVector3D(
+              (col - width / 2.) * volume.pixel_width * factor,
+              (row - height / 2.) * volume.pixel_height * factor,
+              (layer - depth / 2.) * volume.slice_spacing * factor));
+  return positions;
+}
+
+bool check(bool condition, const std::string &msg) {
+  std::cout << (condition ? "[ok] " : "[FAILED] ") << msg << std::endl;
+  return condition;
+}
+
+bool checkPoints(const std::vector<DrawablePoint> &points,
+                 const std::vector<QVector3D> &expected,
+                 const std::string &msg) {
+  bool same = points.size() == expected.size();
+  for (size_t idx = 0; same && idx < points.size(); idx++)
+    same = (points[idx].pos - expected[idx]).length() < 1e-6;
+  return check(same, msg + ": " + std::to_string(points.size()) +
+                         " points, " + std::to_string(expected.size()) +
+                         " expected");
+}
+} // namespace
+
+int main() {
+  WindowedVolumicData volume(width, height, depth, 0, 1000);
+  volume.pixel_width = 0.5;
+  volume.pixel_height = 0.5;
+  volume.slice_spacing = 1;
+  bool success = check(volume.getNbVoxels() > ((size_t)1 << 31),
+                       "Volume of " + std::to_string(volume.getNbVoxels()) +
+                           " voxels");
+  for (int layer = 0; layer < depth; layer++) {
+    uint8_t *voxels = volume.getLayerData(layer);
+    std::fill(voxels, voxels + (size_t)width * height, 0);
+    for (int row = cube_begin[1]; row < cube_begin[1] + cube_size; row++)
+      for (int col = cube_begin[0]; col < cube_begin[0] + cube_size; col++)
+        if (isInCube(col, row, layer))
+          voxels[col + (size_t)width * row] = 200;
+    volume.updateLayerSummary(layer);
+    volume.setLayerReady(layer);
+  }
+
+  size_t first_idx = volume.getIndex(cube_begin[0], cube_begin[1],
+                                     cube_begin[2]);
+  QVector3D coordinate = volume.getCoordinate(first_idx);
+  success &= check(first_idx > ((size_t)1 << 31) &&
+                       coordinate == QVector3D(cube_begin[0], cube_begin[1],
+                                               cube_begin[2]),
+                   "Coordinate of voxel " + std::to_string(first_idx));
+
+  for (bool contours_mode : {false, true}) {
+    PointExtractor extractor;
+    extractor.threshold_min = 100;
+    extractor.threshold_max = 1000;
+    extractor.contours_mode = contours_mode;
+    std::vector<QVector3D> expected =
+        getExpectedPositions(volume, contours_mode);
+    std::string mode = contours_mode ? "contours" : "all voxels";
+    std::vector<DrawablePoint> points;
+    extractor.extract(
+        volume, [&points](const DrawablePoint &p) { points.push_back(p); });
+    success &= checkPoints(points, expected, "extract, " + mode);
+    success &= checkPoints(extractor.extractPoints(volume), expected,
+                           "extractPoints, " + mode);
+  }
+  return success ? 0 : 1;
+}
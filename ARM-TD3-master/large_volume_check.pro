@@ -0,0 +1,21 @@
+#-------------------------------------------------
+#
+# Check of the extraction of volumes with more than 2^31 voxels
+#
+#-------------------------------------------------
+
+# QtGui is only required for QVector3D, no display is used
+QT       += core gui
+QT       -= widgets
+
+TARGET = large_volume_check
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+include(dicom_core.pri)
+
+SOURCES += \
+        large_volume_check.cpp
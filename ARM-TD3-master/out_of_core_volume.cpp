@@ -0,0 +1,437 @@
+#include "out_of_core_volume.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+const char brick_magic[8] = {'D', 'V', 'B', 'R', 'I', 'C', 'K', 'S'};
+const uint32_t brick_version = 1;
+/// Offset of the first brick in the file [bytes]
+const uint64_t brick_data_offset = 4096;
+
+/// Identifier of the voxel types, int16 Hounsfield units use the same value
+/// as the volume cache
+template <typename T> int32_t getVoxelType();
+template <> int32_t getVoxelType<int16_t>() { return 1; }
+template <> int32_t getVoxelType<uint8_t>() { return 2; }
+template <> int32_t getVoxelType<float>() { return 3; }
+
+/// The header written at the beginning of brick files
+struct BrickHeader {
+  char magic[8];
+  uint32_t version;
+  /// Size of a voxel [bytes]
+  uint32_t voxel_size;
+  int32_t voxel_type;
+  int32_t width;
+  int32_t height;
+  int32_t depth;
+  int32_t brick_size;
+  int32_t padding;
+  double pixel_width;
+  double pixel_height;
+  double slice_spacing;
+  double win_min;
+  double win_max;
+};
+
+int getNbBricks(int size, int brick_size) {
+  return (size + brick_size - 1) / brick_size;
+}
+
+/// Size of a brick in the file [bytes]
+template <typename T> qint64 getBrickBytes(const BrickFileInfo &info) {
+  return (qint64)info.brick_size * info.brick_size * info.brick_size *
+         sizeof(T);
+}
+
+/// Size of the largest slab returned by OutOfCoreVolume::readSlab [bytes]
+template <typename T> size_t getSlabBytes(const BrickFileInfo &info) {
+  return (size_t)info.width * info.height *
+         (info.brick_size + OutOfCoreVolume<T>::max_slab_margin) * sizeof(T);
+}
+} // namespace
+
+template <typename T>
+BrickFileWriter<T>::BrickFileWriter(const std::string &path,
+                                    const BrickFileInfo &info)
+    : path(path), info(info),
+      file(QString::fromStdString(path + ".tmp")) {}
+
+template <typename T> BrickFileWriter<T>::~BrickFileWriter() {
+  if (file.isOpen()) {
+    file.close();
+    file.remove();
+  }
+}
+
+template <typename T>
+std::unique_ptr<BrickFileWriter<T>>
+BrickFileWriter<T>::create(const std::string &path,
+                           const BrickFileInfo &info) {
+  std::unique_ptr<BrickFileWriter> writer(new BrickFileWriter(path, info));
+  // Writing to a temporary file first, so that an interrupted conversion
+  // never leaves a truncated brick file behind
+  QFile &file = writer->file;
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    std::cerr << "Failed to write brick file " << file.fileName().toStdString()
+              << ": " << file.errorString().toStdString() << std::endl;
+    return nullptr;
+  }
+  BrickHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, brick_magic, sizeof(brick_magic));
+  header.version = brick_version;
+  header.voxel_size = sizeof(T);
+  header.voxel_type = getVoxelType<T>();
+  header.width = info.width;
+  header.height = info.height;
+  header.depth = info.depth;
+  header.brick_size = info.brick_size;
+  header.pixel_width = info.pixel_width;
+  header.pixel_height = info.pixel_height;
+  header.slice_spacing = info.slice_spacing;
+  header.win_min = info.win_min;
+  header.win_max = info.win_max;
+  qint64 nb_bricks = (qint64)getNbBricks(info.width, info.brick_size) *
+                     getNbBricks(info.height, info.brick_size) *
+                     getNbBricks(info.depth, info.brick_size);
+  // Sizing the file first, so that bricks can be written at their offset
+  if (file.write((const char *)&header, sizeof(header)) != sizeof(header) ||
+      !file.resize(brick_data_offset + nb_bricks * getBrickBytes<T>(info))) {
+    std::cerr << "Failed to write brick file " << file.fileName().toStdString()
+              << std::endl;
+    file.close();
+    file.remove();
+    return nullptr;
+  }
+  return writer;
+}
+
+template <typename T>
+bool BrickFileWriter<T>::writeSlab(const BasicVolumicData<T> &slab,
+                                   int first_layer) {
+  const int size = info.brick_size;
+  if (first_layer % size != 0 || slab.width != info.width ||
+      slab.height != info.height ||
+      slab.depth != std::min(size, info.depth - first_layer)) {
+    std::cerr << "Invalid slab at layer " << first_layer << " for brick file "
+              << path << std::endl;
+    return false;
+  }
+  const int nb_bricks_x = getNbBricks(info.width, size);
+  const int nb_bricks_y = getNbBricks(info.height, size);
+  const int brick_z = first_layer / size;
+  std::vector<T> brick((size_t)size * size * size);
+  for (int brick_y = 0; brick_y < nb_bricks_y; brick_y++) {
+    for (int brick_x = 0; brick_x < nb_bricks_x; brick_x++) {
+      std::fill(brick.begin(), brick.end(), T(0));
+      int x_begin = brick_x * size;
+      int nb_cols = std::min(size, info.width - x_begin);
+      for (int z = 0; z < slab.depth; z++) {
+        for (int y = 0; y < size && brick_y * size + y < info.height; y++) {
+          const T *line =
+              slab.getLayerData(z) + x_begin +
+              (size_t)slab.width * (brick_y * size + y);
+          std::copy(line, line + nb_cols,
+                    brick.begin() + (size_t)size * (y + (size_t)size * z));
+        }
+      }
+      qint64 brick_idx =
+          brick_x + nb_bricks_x * (brick_y + (qint64)nb_bricks_y * brick_z);
+      qint64 nb_bytes = getBrickBytes<T>(info);
+      if (!file.seek(brick_data_offset + brick_idx * nb_bytes) ||
+          file.write((const char *)brick.data(), nb_bytes) != nb_bytes) {
+        std::cerr << "Failed to write brick file " << path << ": "
+                  << file.errorString().toStdString() << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+template <typename T> bool BrickFileWriter<T>::close() {
+  file.close();
+  if (file.error() != QFileDevice::NoError) {
+    std::cerr << "Failed to write brick file " << path << ": "
+              << file.errorString().toStdString() << std::endl;
+    file.remove();
+    return false;
+  }
+  QFile::remove(QString::fromStdString(path));
+  return file.rename(QString::fromStdString(path));
+}
+
+template <typename T>
+OutOfCoreVolume<T>::OutOfCoreVolume(std::unique_ptr<QFile> file,
+                                    const BrickFileInfo &info,
+                                    size_t memory_cap)
+    : file(std::move(file)), info(info),
+      nb_bricks_x(getNbBricks(info.width, info.brick_size)),
+      nb_bricks_y(getNbBricks(info.height, info.brick_size)),
+      nb_bricks_z(getNbBricks(info.depth, info.brick_size)),
+      nb_brick_loads(0), last_slab_z(-1), read_direction(1),
+      stop_prefetch(false) {
+  // What is left once the slab returned by readSlab is counted, open
+  // checked that it holds the slab being read and the prefetched one
+  max_bricks = (memory_cap - getSlabBytes<T>(info)) / getBrickBytes<T>(info);
+  prefetch_thread = std::thread(&OutOfCoreVolume::prefetchLoop, this);
+}
+
+template <typename T> OutOfCoreVolume<T>::~OutOfCoreVolume() {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    stop_prefetch = true;
+  }
+  prefetch_condition.notify_all();
+  prefetch_thread.join();
+}
+
+template <typename T>
+std::unique_ptr<OutOfCoreVolume<T>>
+OutOfCoreVolume<T>::open(const std::string &path, size_t memory_cap) {
+  std::unique_ptr<QFile> file(new QFile(QString::fromStdString(path)));
+  if (!file->open(QIODevice::ReadOnly)) {
+    std::cerr << "Failed to open brick file " << path << ": "
+              << file->errorString().toStdString() << std::endl;
+    return nullptr;
+  }
+  BrickHeader header;
+  if (file->read((char *)&header, sizeof(header)) != sizeof(header) ||
+      std::memcmp(header.magic, brick_magic, sizeof(brick_magic)) != 0 ||
+      header.version != brick_version || header.voxel_size != sizeof(T) ||
+      header.voxel_type != getVoxelType<T>() || header.brick_size <= 0) {
+    std::cerr << "Invalid brick file: " << path << std::endl;
+    return nullptr;
+  }
+  BrickFileInfo info;
+  info.width = header.width;
+  info.height = header.height;
+  info.depth = header.depth;
+  info.brick_size = header.brick_size;
+  info.pixel_width = header.pixel_width;
+  info.pixel_height = header.pixel_height;
+  info.slice_spacing = header.slice_spacing;
+  info.win_min = header.win_min;
+  info.win_max = header.win_max;
+  qint64 nb_bricks = (qint64)getNbBricks(info.width, info.brick_size) *
+                     getNbBricks(info.height, info.brick_size) *
+                     getNbBricks(info.depth, info.brick_size);
+  if (file->size() < (qint64)brick_data_offset +
+                         nb_bricks * getBrickBytes<T>(info)) {
+    std::cerr << "Truncated brick file: " << path << std::endl;
+    return nullptr;
+  }
+  if (memory_cap < getMinMemoryCap(info)) {
+    std::cerr << "Memory cap of " << memory_cap << " bytes below the "
+              << getMinMemoryCap(info) << " bytes needed to read " << path
+              << std::endl;
+    return nullptr;
+  }
+  return std::unique_ptr<OutOfCoreVolume>(
+      new OutOfCoreVolume(std::move(file), info, memory_cap));
+}
+
+template <typename T>
+size_t OutOfCoreVolume<T>::getMinMemoryCap(const BrickFileInfo &info) {
+  size_t slab_bricks = (size_t)getNbBricks(info.width, info.brick_size) *
+                       getNbBricks(info.height, info.brick_size);
+  return 2 * slab_bricks * getBrickBytes<T>(info) + getSlabBytes<T>(info);
+}
+
+template <typename T>
+const BrickFileInfo &OutOfCoreVolume<T>::getInfo() const {
+  return info;
+}
+
+template <typename T>
+void OutOfCoreVolume<T>::setWindow(double win_min, double win_max) {
+  info.win_min = win_min;
+  info.win_max = win_max;
+}
+
+template <typename T>
+T OutOfCoreVolume<T>::getValue(int col, int row, int layer) {
+  const int size = info.brick_size;
+  size_t brick_idx = col / size + (size_t)nb_bricks_x *
+                                      (row / size + (size_t)nb_bricks_y *
+                                                        (layer / size));
+  BrickPtr brick = getBrick(brick_idx);
+  return (*brick)[col % size +
+                  (size_t)size * (row % size + (size_t)size * (layer % size))];
+}
+
+template <typename T>
+void OutOfCoreVolume<T>::readLayer(int layer, T *voxels) {
+  updateReadPosition(layer / info.brick_size);
+  copyLayer(layer, voxels);
+}
+
+template <typename T>
+void OutOfCoreVolume<T>::updateReadPosition(int slab_z) {
+  int next_slab_z = -1;
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (slab_z != last_slab_z) {
+      if (last_slab_z >= 0)
+        read_direction = slab_z > last_slab_z ? 1 : -1;
+      last_slab_z = slab_z;
+      next_slab_z = slab_z + read_direction;
+    }
+  }
+  prefetchSlab(next_slab_z);
+}
+
+template <typename T>
+void OutOfCoreVolume<T>::copyLayer(int layer, T *voxels) {
+  const int size = info.brick_size;
+  const int slab_z = layer / size;
+  const int z = layer % size;
+  for (int brick_y = 0; brick_y < nb_bricks_y; brick_y++) {
+    for (int brick_x = 0; brick_x < nb_bricks_x; brick_x++) {
+      size_t brick_idx =
+          brick_x + nb_bricks_x * (brick_y + (size_t)nb_bricks_y * slab_z);
+      BrickPtr brick = getBrick(brick_idx);
+      int x_begin = brick_x * size;
+      int nb_cols = std::min(size, info.width - x_begin);
+      for (int y = 0; y < size && brick_y * size + y < info.height; y++) {
+        const T *line =
+            brick->data() + (size_t)size * (y + (size_t)size * z);
+        std::copy(line, line + nb_cols,
+                  voxels + x_begin +
+                      (size_t)info.width * (brick_y * size + y));
+      }
+    }
+  }
+}
+
+template <typename T>
+std::unique_ptr<BasicVolumicData<T>>
+OutOfCoreVolume<T>::readSlab(int first_layer, int nb_layers) {
+  int begin = std::max(first_layer, 0);
+  int end = std::min(first_layer + nb_layers, info.depth);
+  std::unique_ptr<BasicVolumicData<T>> slab(
+      new BasicVolumicData<T>(info.width, info.height,
+                              std::max(end - begin, 0), info.win_min,
+                              info.win_max));
+  slab->pixel_width = info.pixel_width;
+  slab->pixel_height = info.pixel_height;
+  slab->slice_spacing = info.slice_spacing;
+  // The margins of a slab must not reverse the direction of the reads
+  if (end > begin)
+    updateReadPosition((begin + end - 1) / 2 / info.brick_size);
+  for (int layer = begin; layer < end; layer++) {
+    copyLayer(layer, slab->getLayerData(layer - begin));
+    slab->updateLayerSummary(layer - begin);
+    slab->setLayerReady(layer - begin);
+  }
+  return slab;
+}
+
+template <typename T> size_t OutOfCoreVolume<T>::getNbBrickLoads() const {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  return nb_brick_loads;
+}
+
+template <typename T>
+typename OutOfCoreVolume<T>::BrickPtr
+OutOfCoreVolume<T>::getBrick(size_t brick_idx) {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cached_bricks.find(brick_idx);
+    if (it != cached_bricks.end()) {
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->second;
+    }
+  }
+  // Loaded without holding the cache, other threads keep using it meanwhile
+  BrickPtr brick = loadBrick(brick_idx);
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  auto it = cached_bricks.find(brick_idx);
+  if (it != cached_bricks.end())
+    return it->second->second;
+  insertBrick(brick_idx, brick);
+  return brick;
+}
+
+template <typename T>
+typename OutOfCoreVolume<T>::BrickPtr
+OutOfCoreVolume<T>::loadBrick(size_t brick_idx) {
+  qint64 nb_bytes = getBrickBytes<T>(info);
+  std::shared_ptr<std::vector<T>> brick(
+      new std::vector<T>(nb_bytes / sizeof(T)));
+  std::lock_guard<std::mutex> lock(file_mutex);
+  if (!file->seek(brick_data_offset + brick_idx * nb_bytes) ||
+      file->read((char *)brick->data(), nb_bytes) != nb_bytes)
+    throw std::runtime_error("Failed to read brick " +
+                             std::to_string(brick_idx) + " from " +
+                             file->fileName().toStdString());
+  return brick;
+}
+
+template <typename T>
+void OutOfCoreVolume<T>::insertBrick(size_t brick_idx, BrickPtr brick) {
+  lru.emplace_front(brick_idx, brick);
+  cached_bricks[brick_idx] = lru.begin();
+  nb_brick_loads++;
+  // Evicted bricks stay alive as long as a reader holds them
+  while (lru.size() > max_bricks) {
+    cached_bricks.erase(lru.back().first);
+    lru.pop_back();
+  }
+}
+
+template <typename T> void OutOfCoreVolume<T>::prefetchSlab(int slab_z) {
+  if (slab_z < 0 || slab_z >= nb_bricks_z)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    size_t slab_bricks = (size_t)nb_bricks_x * nb_bricks_y;
+    for (size_t idx = 0; idx < slab_bricks; idx++) {
+      size_t brick_idx = slab_z * slab_bricks + idx;
+      if (cached_bricks.count(brick_idx) == 0 &&
+          pending_bricks.insert(brick_idx).second)
+        prefetch_queue.push_back(brick_idx);
+    }
+  }
+  prefetch_condition.notify_one();
+}
+
+template <typename T> void OutOfCoreVolume<T>::prefetchLoop() {
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  while (true) {
+    prefetch_condition.wait(
+        lock, [this]() { return stop_prefetch || !prefetch_queue.empty(); });
+    if (stop_prefetch)
+      return;
+    size_t brick_idx = prefetch_queue.front();
+    prefetch_queue.pop_front();
+    if (cached_bricks.count(brick_idx) != 0) {
+      pending_bricks.erase(brick_idx);
+      continue;
+    }
+    lock.unlock();
+    BrickPtr brick;
+    try {
+      brick = loadBrick(brick_idx);
+    } catch (const std::runtime_error &) {
+      // The error is reported when the brick is actually read
+    }
+    lock.lock();
+    // Still pending while loaded, so that it is not queued again meanwhile
+    pending_bricks.erase(brick_idx);
+    if (brick && cached_bricks.count(brick_idx) == 0)
+      insertBrick(brick_idx, brick);
+  }
+}
+
+template class BrickFileWriter<int16_t>;
+template class BrickFileWriter<uint8_t>;
+template class BrickFileWriter<float>;
+
+template class OutOfCoreVolume<int16_t>;
+template class OutOfCoreVolume<uint8_t>;
+template class OutOfCoreVolume<float>;
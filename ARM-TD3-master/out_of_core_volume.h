@@ -0,0 +1,177 @@
+#ifndef OUT_OF_CORE_VOLUME_H
+#define OUT_OF_CORE_VOLUME_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <QFile>
+
+#include "volumic_data.h"
+
+/// Volumes stored on disk as bricks, for volumes which do not fit in memory
+///
+/// A brick file is made of a fixed size header followed by the bricks of
+/// brick_size^3 voxels, stored x-fastest then y then z. Inside a brick the
+/// voxels are stored column by column, line by line, slice by slice, the
+/// voxels outside of the volume being set to 0. All the bricks have the same
+/// size so that their offset is computed directly.
+
+/// Properties of the volume stored in a brick file
+struct BrickFileInfo {
+  int width;
+  int height;
+  int depth;
+  /// Number of voxels along each side of a brick
+  int brick_size;
+  double pixel_width;
+  double pixel_height;
+  double slice_spacing;
+  /// The default window [HU]
+  double win_min;
+  double win_max;
+};
+
+/// Writes a brick file slab by slab, so that only brick_size layers of the
+/// volume are in memory at once
+template <typename T> class BrickFileWriter {
+public:
+  /// Create the file at 'path', return nullptr on failure after printing the
+  /// reason on std::cerr
+  static std::unique_ptr<BrickFileWriter> create(const std::string &path,
+                                                 const BrickFileInfo &info);
+  /// Remove the temporary file if close has not been called
+  ~BrickFileWriter();
+
+  /// Write the layers of 'slab' starting at 'first_layer', which must be a
+  /// multiple of brick_size. 'slab' holds brick_size layers, except for the
+  /// last slab of the volume.
+  /// On failure, return false and print the reason on std::cerr
+  bool writeSlab(const BasicVolumicData<T> &slab, int first_layer);
+
+  /// Finalize the file once all the slabs have been written
+  /// On failure, return false and print the reason on std::cerr
+  bool close();
+
+private:
+  BrickFileWriter(const std::string &path, const BrickFileInfo &info);
+
+  std::string path;
+  BrickFileInfo info;
+  QFile file;
+};
+
+/// A volume read from a brick file through a bounded cache of bricks
+///
+/// Bricks are loaded on demand and the least recently used ones are dropped
+/// once the cache exceeds its memory cap. Reading a layer also schedules the
+/// bricks of the next slab along the direction of the reads, which are
+/// loaded by a background thread.
+///
+/// The memory cap covers the cached bricks and one slab of at most
+/// max_slab_margin layers more than a slab of bricks returned by readSlab.
+/// The volume is only used by dicom_batch, the viewer keeps its volumes in
+/// memory and its slice view does not read brick files.
+///
+/// All the methods can be called from several threads.
+template <typename T> class OutOfCoreVolume {
+public:
+  /// Layers read by readSlab beyond a slab of bricks, e.g. the neighbour
+  /// layers needed by contours, which are counted in the memory cap
+  static const int max_slab_margin = 2;
+
+  /// Open the brick file at 'path', keeping at most 'memory_cap' bytes in
+  /// memory
+  /// Return nullptr on failure after printing the reason on std::cerr, in
+  /// particular if 'memory_cap' is below getMinMemoryCap
+  static std::unique_ptr<OutOfCoreVolume> open(const std::string &path,
+                                               size_t memory_cap);
+  /// Smallest memory cap of a volume described by 'info' [bytes]: two slabs
+  /// of bricks, the one being read and the prefetched one, and the slab
+  /// returned by readSlab
+  static size_t getMinMemoryCap(const BrickFileInfo &info);
+  ~OutOfCoreVolume();
+
+  const BrickFileInfo &getInfo() const;
+  /// Replace the default window, must be called before reading the volume
+  void setWindow(double win_min, double win_max);
+
+  T getValue(int col, int row, int layer);
+  /// Copy the width*height voxels of 'layer' to 'voxels'
+  void readLayer(int layer, T *voxels);
+  /// Load the layers [first_layer, first_layer + nb_layers) in memory, the
+  /// range being clipped to the volume. All the layers of the result are
+  /// ready.
+  /// - The memory cap only holds if 'nb_layers' is at most brick_size +
+  ///   max_slab_margin and the previous slab has been released
+  std::unique_ptr<BasicVolumicData<T>> readSlab(int first_layer,
+                                                int nb_layers);
+
+  /// Number of bricks loaded into the cache so far, including the
+  /// prefetched ones
+  size_t getNbBrickLoads() const;
+
+private:
+  typedef std::shared_ptr<const std::vector<T>> BrickPtr;
+
+  OutOfCoreVolume(std::unique_ptr<QFile> file, const BrickFileInfo &info,
+                  size_t memory_cap);
+
+  /// Retrieve brick 'brick_idx' from the cache, loading it if needed
+  BrickPtr getBrick(size_t brick_idx);
+  /// Read brick 'brick_idx' from the file
+  BrickPtr loadBrick(size_t brick_idx);
+  /// Add a loaded brick to the cache, evicting the oldest ones if needed
+  /// - cache_mutex must be locked
+  void insertBrick(size_t brick_idx, BrickPtr brick);
+  /// Record a read in slab 'slab_z' and prefetch the next slab along the
+  /// direction of the reads
+  void updateReadPosition(int slab_z);
+  /// Copy 'layer' from its bricks to 'voxels'
+  void copyLayer(int layer, T *voxels);
+  /// Schedule the prefetch of the bricks of slab 'slab_z'
+  void prefetchSlab(int slab_z);
+  /// Body of the prefetch thread
+  void prefetchLoop();
+
+  std::unique_ptr<QFile> file;
+  BrickFileInfo info;
+  int nb_bricks_x;
+  int nb_bricks_y;
+  int nb_bricks_z;
+  /// Maximal number of bricks in the cache
+  size_t max_bricks;
+
+  /// Protects the reads from 'file'
+  std::mutex file_mutex;
+
+  /// Protects the cache and the prefetch queue
+  mutable std::mutex cache_mutex;
+  /// Bricks by order of use, the most recent first
+  std::list<std::pair<size_t, BrickPtr>> lru;
+  std::map<size_t, typename std::list<std::pair<size_t, BrickPtr>>::iterator>
+      cached_bricks;
+  size_t nb_brick_loads;
+  /// Slab of the last layer read and direction of the reads (+1 or -1)
+  int last_slab_z;
+  int read_direction;
+
+  std::deque<size_t> prefetch_queue;
+  /// Bricks queued or being loaded by the prefetch thread, which are not
+  /// queued again
+  std::set<size_t> pending_bricks;
+  std::condition_variable prefetch_condition;
+  bool stop_prefetch;
+  std::thread prefetch_thread;
+};
+
+#endif // OUT_OF_CORE_VOLUME_H
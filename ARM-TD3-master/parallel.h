@@ -0,0 +1,57 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Number of workers used when no explicit thread count is requested
+inline int getDefaultNbThreads() {
+  unsigned int nb_cores = std::thread::hardware_concurrency();
+  return nb_cores == 0 ? 1 : (int)nb_cores;
+}
+
+/// Call 'task(idx)' for every idx in [begin, end) on a pool of workers
+/// - Indices are handed out one at a time, so tasks of heterogeneous cost
+///   (e.g. compressed and raw files) stay balanced between workers
+/// - 'nb_threads' <= 0 uses one worker per core, the calling thread being one
+///   of the workers
+/// - If a task throws, remaining indices are skipped and the first exception
+///   is rethrown once all the workers have been joined
+template <typename Task>
+void parallelFor(size_t begin, size_t end, Task task, int nb_threads = 0) {
+  if (end <= begin)
+    return;
+  if (nb_threads <= 0)
+    nb_threads = getDefaultNbThreads();
+  nb_threads = (int)std::min<size_t>(nb_threads, end - begin);
+  std::atomic<size_t> next_idx(begin);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto worker = [&]() {
+    for (size_t idx = next_idx++; idx < end; idx = next_idx++) {
+      try {
+        task(idx);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+        next_idx = end;
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < nb_threads; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (std::thread &w : workers)
+    w.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+#endif // PARALLEL_H
@@ -0,0 +1,495 @@
+#include "point_extractor.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#include "parallel.h"
+
+namespace {
+/// Settings an extraction kernel is compiled for
+template <int Neighbourhood, bool ColorMode, bool Highlight, bool HideEmpty>
+struct KernelSettings {
+  static const int neighbourhood = Neighbourhood;
+  static const bool color_mode = ColorMode;
+  static const bool highlight = Highlight;
+  static const bool hide_empty_points = HideEmpty;
+};
+
+template <int Neighbourhood, bool ColorMode, bool Highlight,
+          typename Function>
+void dispatchFlags(bool hide_empty_points, const Function &function) {
+  if (hide_empty_points)
+    function(KernelSettings<Neighbourhood, ColorMode, Highlight, true>());
+  else
+    function(KernelSettings<Neighbourhood, ColorMode, Highlight, false>());
+}
+
+template <int Neighbourhood, bool ColorMode, typename Function>
+void dispatchFlags(bool highlight, bool hide_empty_points,
+                   const Function &function) {
+  if (highlight)
+    dispatchFlags<Neighbourhood, ColorMode, true>(hide_empty_points,
+                                                  function);
+  else
+    dispatchFlags<Neighbourhood, ColorMode, false>(hide_empty_points,
+                                                   function);
+}
+
+/// Call 'function' with the KernelSettings of 'Neighbourhood' and of the
+/// given flags
+template <int Neighbourhood, typename Function>
+void dispatchFlags(bool color_mode, bool highlight, bool hide_empty_points,
+                   const Function &function) {
+  if (color_mode)
+    dispatchFlags<Neighbourhood, true>(highlight, hide_empty_points,
+                                       function);
+  else
+    dispatchFlags<Neighbourhood, false>(highlight, hide_empty_points,
+                                        function);
+}
+} // namespace
+
+PointExtractor::PointExtractor()
+    : threshold_min(0), threshold_max(0), contours_mode(false),
+      color_mode(false), hide_below(false), hide_above(false),
+      highlight(false), active_slice(1), alpha(0.05),
+      hide_empty_points(true), contours_neighbourhood(0),
+      specialised_kernels(true) {}
+
+template <typename T>
+size_t PointExtractor::extract(
+    const BasicVolumicData<T> &volume,
+    const std::function<void(const DrawablePoint &)> &on_point,
+    const BrickedVolume<T> *bricked) const {
+  int layer_start, layer_end;
+  getLayerRange(volume.depth, &layer_start, &layer_end);
+  const VoxelClassifier<T> classifier =
+      createClassifier<T>(volume.win_min, volume.win_max);
+  std::unique_ptr<LabelVolume> labels =
+      createLabels(volume, classifier, layer_start, layer_end, 0);
+  return extractLayers(volume, bricked, classifier, labels.get(), 0,
+                       volume.depth, layer_start, layer_end, on_point);
+}
+
+template <typename T>
+std::vector<DrawablePoint>
+PointExtractor::extractPoints(const BasicVolumicData<T> &volume,
+                              const BrickedVolume<T> *bricked,
+                              int nb_threads) const {
+  int layer_start, layer_end;
+  getLayerRange(volume.depth, &layer_start, &layer_end);
+  const VoxelClassifier<T> classifier =
+      createClassifier<T>(volume.win_min, volume.win_max);
+  std::unique_ptr<LabelVolume> labels =
+      createLabels(volume, classifier, layer_start, layer_end, nb_threads);
+  return extractPointsInParallel(volume, bricked, classifier, labels.get(),
+                                 nb_threads);
+}
+
+template <typename T>
+std::vector<DrawablePoint>
+PointExtractor::extractPoints(const BasicVolumicData<T> &volume,
+                              const LabelVolume &labels,
+                              int nb_threads) const {
+  return extractPointsInParallel<T>(
+      volume, nullptr, createClassifier<T>(volume.win_min, volume.win_max),
+      &labels, nb_threads);
+}
+
+template <typename T>
+std::vector<DrawablePoint> PointExtractor::extractPointsInParallel(
+    const BasicVolumicData<T> &volume, const BrickedVolume<T> *bricked,
+    const VoxelClassifier<T> &classifier, const LabelVolume *labels,
+    int nb_threads) const {
+  int layer_start, layer_end;
+  getLayerRange(volume.depth, &layer_start, &layer_end);
+  size_t nb_layers = std::max(layer_end - layer_start, 0);
+  // Layers are handed out one at a time, so that the workers stay balanced
+  // when some layers are mostly empty
+  std::vector<std::vector<DrawablePoint>> layer_points(nb_layers);
+  dispatchKernel([&](auto settings) {
+    parallelFor(
+        0, nb_layers,
+        [&](size_t idx) {
+          std::vector<DrawablePoint> &points = layer_points[idx];
+          int layer = layer_start + idx;
+          extractLayersKernel<T, decltype(settings)>(
+              volume, bricked, classifier, labels, 0, volume.depth, layer,
+              layer + 1,
+              [&points](const DrawablePoint &p) { points.push_back(p); });
+        },
+        nb_threads);
+  });
+
+  std::vector<size_t> offsets(nb_layers + 1, 0);
+  for (size_t idx = 0; idx < nb_layers; idx++)
+    offsets[idx + 1] = offsets[idx] + layer_points[idx].size();
+  std::vector<DrawablePoint> points(offsets.back());
+  parallelFor(
+      0, nb_layers,
+      [&](size_t idx) {
+        std::copy(layer_points[idx].begin(), layer_points[idx].end(),
+                  points.begin() + offsets[idx]);
+        std::vector<DrawablePoint>().swap(layer_points[idx]);
+      },
+      nb_threads);
+  return points;
+}
+
+template <typename T>
+size_t PointExtractor::extract(
+    OutOfCoreVolume<T> &volume,
+    const std::function<void(const DrawablePoint &)> &on_point) const {
+  const BrickFileInfo &info = volume.getInfo();
+  int layer_start, layer_end;
+  getLayerRange(info.depth, &layer_start, &layer_end);
+  // Contours need the layers surrounding the slab
+  int margin = contours_mode ? 1 : 0;
+  const VoxelClassifier<T> classifier =
+      createClassifier<T>(info.win_min, info.win_max);
+  size_t nb_points = 0;
+  int slab_end;
+  for (int slab_start = layer_start; slab_start < layer_end;
+       slab_start = slab_end) {
+    slab_end =
+        std::min((slab_start / info.brick_size + 1) * info.brick_size,
+                 layer_end);
+    std::unique_ptr<BasicVolumicData<T>> slab = volume.readSlab(
+        slab_start - margin, slab_end - slab_start + 2 * margin);
+    int first_layer = std::max(slab_start - margin, 0);
+    std::unique_ptr<LabelVolume> labels =
+        createLabels(*slab, classifier, slab_start - first_layer,
+                     slab_end - first_layer, 0);
+    nb_points += extractLayers<T>(*slab, nullptr, classifier, labels.get(),
+                                  first_layer, info.depth, slab_start,
+                                  slab_end, on_point);
+  }
+  return nb_points;
+}
+
+size_t PointExtractor::extract(
+    const CompressedVolume &volume,
+    const std::function<void(const DrawablePoint &)> &on_point) const {
+  const int brick_size = CompressedVolume::brick_size;
+  int layer_start, layer_end;
+  getLayerRange(volume.depth, &layer_start, &layer_end);
+  int margin = contours_mode ? 1 : 0;
+  const VoxelClassifier<VolumicData::Voxel> classifier =
+      createClassifier<VolumicData::Voxel>(volume.win_min, volume.win_max);
+  size_t nb_points = 0;
+  int slab_end;
+  for (int slab_start = layer_start; slab_start < layer_end;
+       slab_start = slab_end) {
+    slab_end = std::min((slab_start / brick_size + 1) * brick_size, layer_end);
+    std::unique_ptr<VolumicData> slab = volume.readSlab(
+        slab_start - margin, slab_end - slab_start + 2 * margin);
+    int first_layer = std::max(slab_start - margin, 0);
+    std::unique_ptr<LabelVolume> labels =
+        createLabels(*slab, classifier, slab_start - first_layer,
+                     slab_end - first_layer, 0);
+    nb_points += extractLayers<VolumicData::Voxel>(
+        *slab, nullptr, classifier, labels.get(), first_layer, volume.depth,
+        slab_start, slab_end, on_point);
+  }
+  return nb_points;
+}
+
+void PointExtractor::getLayerRange(int depth, int *layer_start,
+                                   int *layer_end) const {
+  *layer_start = hide_below ? active_slice - 1 : 0;
+  *layer_end = hide_above ? active_slice : depth;
+  *layer_start = std::max(*layer_start, 0);
+  *layer_end = std::min(*layer_end, depth);
+}
+
+template <typename T>
+VoxelClassifier<T> PointExtractor::createClassifier(double win_min,
+                                                    double win_max) const {
+  return VoxelClassifier<T>(win_min, win_max, threshold_min, threshold_max,
+                            color_mode, hide_empty_points);
+}
+
+template <typename T>
+std::unique_ptr<LabelVolume>
+PointExtractor::createLabels(const BasicVolumicData<T> &volume,
+                             const VoxelClassifier<T> &classifier,
+                             int layer_start, int layer_end,
+                             int nb_threads) const {
+  if (!contours_mode || !specialised_kernels || layer_end <= layer_start)
+    return nullptr;
+  // The contours of a layer depend on the layers next to it
+  int first_label = std::max(layer_start - 1, 0);
+  int end_label = std::min(layer_end + 1, volume.depth);
+  return std::unique_ptr<LabelVolume>(new LabelVolume(
+      volume, classifier, first_label, end_label - first_label, nb_threads));
+}
+
+int PointExtractor::getContoursNeighbourhood() const {
+  switch (contours_neighbourhood) {
+  case 0:
+    return color_mode ? 6 : 26;
+  case 6:
+  case 18:
+  case 26:
+    return contours_neighbourhood;
+  default:
+    throw std::invalid_argument(
+        "PointExtractor: contours neighbourhood must be 0, 6, 18 or 26");
+  }
+}
+
+template <typename Function>
+void PointExtractor::dispatchKernel(const Function &function) const {
+  if (!specialised_kernels) {
+    function(KernelSettings<generic_kernel, false, false, false>());
+    return;
+  }
+  switch (contours_mode ? getContoursNeighbourhood() : 0) {
+  case 0:
+    dispatchFlags<0>(color_mode, highlight, hide_empty_points, function);
+    break;
+  case 6:
+    dispatchFlags<6>(color_mode, highlight, hide_empty_points, function);
+    break;
+  case 18:
+    dispatchFlags<18>(color_mode, highlight, hide_empty_points, function);
+    break;
+  default:
+    dispatchFlags<26>(color_mode, highlight, hide_empty_points, function);
+    break;
+  }
+}
+
+template <typename T>
+size_t PointExtractor::extractLayers(
+    const BasicVolumicData<T> &volume, const BrickedVolume<T> *bricked,
+    const VoxelClassifier<T> &classifier, const LabelVolume *labels,
+    int first_layer, int total_depth, int layer_start, int layer_end,
+    const std::function<void(const DrawablePoint &)> &on_point) const {
+  size_t nb_points = 0;
+  dispatchKernel([&](auto settings) {
+    nb_points = extractLayersKernel<T, decltype(settings)>(
+        volume, bricked, classifier, labels, first_layer, total_depth,
+        layer_start, layer_end, on_point);
+  });
+  return nb_points;
+}
+
+template <typename T, typename Settings, typename Sink>
+size_t PointExtractor::extractLayersKernel(
+    const BasicVolumicData<T> &volume, const BrickedVolume<T> *bricked,
+    const VoxelClassifier<T> &classifier, const LabelVolume *labels,
+    int first_layer, int total_depth, int layer_start, int layer_end,
+    const Sink &on_point) const {
+  const bool generic = Settings::neighbourhood == generic_kernel;
+  // The generic kernel reads the settings, the others are compiled for them
+  const bool color = generic ? color_mode : Settings::color_mode;
+  const bool highlight_slice = generic ? highlight : Settings::highlight;
+  const bool hide_empty = generic ? hide_empty_points
+                                  : Settings::hide_empty_points;
+  int W = volume.width;
+  int H = volume.height;
+  int D = total_depth;
+  double x_factor = volume.pixel_width;
+  double y_factor = volume.pixel_height;
+  double z_factor = volume.slice_spacing;
+  double max_size =
+      std::max(std::max(x_factor * W, y_factor * H), z_factor * D);
+  double global_factor = 2.0 / max_size;
+  x_factor *= global_factor;
+  y_factor *= global_factor;
+  z_factor *= global_factor;
+
+  // Range of the values which can be extracted, blocks whose values are all
+  // outside of it are skipped without reading their voxels
+  double extracted_min = color ? -1024 : threshold_min;
+  double extracted_max = color ? 1024 : threshold_max;
+  const int block_size = BasicVolumicData<T>::block_size;
+  const int nb_blocks_x = volume.getNbBlocksX();
+  std::vector<bool> active_blocks(nb_blocks_x);
+  // Contour flag of each voxel of the current layer
+  std::vector<uint8_t> boundary(Settings::neighbourhood > 0 ? (size_t)W * H
+                                                            : 0);
+
+  size_t nb_points = 0;
+  for (int depth = layer_start; depth < layer_end; depth++) {
+    int layer = depth - first_layer;
+    if (!volume.isLayerReady(layer))
+      continue; // Layer still being loaded
+    if (Settings::neighbourhood > 0)
+      labels->findBoundary(layer, Settings::neighbourhood, boundary.data());
+    bool highlighted = highlight_slice && depth == active_slice - 1;
+    double layer_alpha = highlighted ? 1.0 : alpha;
+    float z = (depth - D / 2.) * z_factor;
+    for (int row = 0; row < H; row++) {
+      if (row % block_size == 0) {
+        for (int block_x = 0; block_x < nb_blocks_x; block_x++) {
+          double block_min, block_max;
+          volume.getBlockRange(block_x, row / block_size, layer, &block_min,
+                               &block_max);
+          active_blocks[block_x] =
+              block_max >= extracted_min && block_min <= extracted_max &&
+              (!hide_empty || block_max > volume.win_min);
+        }
+      }
+      float y = (row - H / 2.) * y_factor;
+      for (int col = 0; col < W; col++) {
+        if (!active_blocks[col / block_size]) {
+          col += block_size - 1;
+          continue;
+        }
+        if (!generic && labels != nullptr &&
+            labels->getLabel(col, row, layer) == 0)
+          continue;
+        // A single table lookup replaces the windowing and the segmentation
+        T value = volume.getValue(col, row, layer);
+        if (!classifier.isVisible(value))
+          continue;
+        if (generic) {
+          if (contours_mode) {
+            int segment = classifier.getSegment(value);
+            int neighbourhood = getContoursNeighbourhood();
+            bool contour =
+                neighbourhood == 6
+                    ? connectivity<T, 6>(volume, bricked, classifier, col,
+                                         row, layer, segment)
+                    : neighbourhood == 18
+                          ? connectivity<T, 18>(volume, bricked, classifier,
+                                                col, row, layer, segment)
+                          : connectivity<T, 26>(volume, bricked, classifier,
+                                                col, row, layer, segment);
+            if (!contour)
+              continue;
+          }
+        } else if (Settings::neighbourhood > 0 &&
+                   !boundary[col + (size_t)W * row]) {
+          continue;
+        }
+        DrawablePoint p;
+        p.a = layer_alpha;
+        if (generic)
+          p.a = highlight && depth == active_slice - 1 ? 1.0 : alpha;
+        p.color = classifier.getColor(value);
+        p.pos = QVector3D((col - W / 2.) * x_factor, y, z);
+        on_point(p);
+        nb_points++;
+      }
+    }
+  }
+  return nb_points;
+}
+
+namespace {
+/// Indices in a 3x3x3 neighbourhood, x-fastest, of the neighbours of its
+/// center sharing a face, a face or an edge, and any of them
+const int face_neighbours[6] = {4, 10, 12, 14, 16, 22};
+const int edge_neighbours[18] = {1,  3,  4,  5,  7,  9,  10, 11, 12,
+                                 14, 15, 16, 17, 19, 21, 22, 23, 25};
+const int all_neighbours[26] = {0,  1,  2,  3,  4,  5,  6,  7,  8,
+                                9,  10, 11, 12, 14, 15, 16, 17, 18,
+                                19, 20, 21, 22, 23, 24, 25, 26};
+
+inline const int *getNeighbours(int neighbourhood) {
+  return neighbourhood == 6
+             ? face_neighbours
+             : neighbourhood == 18 ? edge_neighbours : all_neighbours;
+}
+} // namespace
+
+template <typename T, int Neighbourhood>
+bool PointExtractor::connectivity(const BasicVolumicData<T> &volume,
+                                  const BrickedVolume<T> *bricked,
+                                  const VoxelClassifier<T> &classifier, int x,
+                                  int y, int z, int curr_segment) const {
+  const int *neighbours = getNeighbours(Neighbourhood);
+  // The loops over the neighbours have a constant length and no early exit,
+  // so that they are unrolled without branches
+  bool outside_segment = false;
+  // Inside of the volume, only the neighbours which are compared are read.
+  // A bricked volume is faster to read by whole neighbourhoods, unless only
+  // the 6 face neighbours are needed.
+  if ((bricked == nullptr || Neighbourhood == 6) && x > 0 && y > 0 && z > 0 &&
+      x < volume.width - 1 && y < volume.height - 1 && z < volume.depth - 1) {
+    for (int i = 0; i < Neighbourhood; i++) {
+      int n = neighbours[i];
+      int new_x = x + n % 3 - 1;
+      int new_y = y + n / 3 % 3 - 1;
+      int new_z = z + n / 9 - 1;
+      T value = bricked != nullptr ? bricked->get(new_x, new_y, new_z)
+                                   : volume.getValue(new_x, new_y, new_z);
+      outside_segment |= classifier.getSegment(value) != curr_segment;
+    }
+    return outside_segment;
+  }
+
+  T values[27] = {};
+  bool inside[27];
+  if (bricked != nullptr) {
+    bricked->getNeighbourhood(x, y, z, values, inside);
+  } else {
+    for (int dz = -1; dz <= 1; ++dz)
+      for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx) {
+          int n = (dx + 1) + 3 * (dy + 1) + 9 * (dz + 1);
+          int new_x = x + dx;
+          int new_y = y + dy;
+          int new_z = z + dz;
+          inside[n] = new_x >= 0 && new_y >= 0 && new_z >= 0 &&
+                      new_x < volume.width && new_y < volume.height &&
+                      new_z < volume.depth;
+          if (inside[n])
+            values[n] = volume.getValue(new_x, new_y, new_z);
+        }
+  }
+  for (int i = 0; i < Neighbourhood; i++) {
+    int n = neighbours[i];
+    outside_segment |=
+        inside[n] & (classifier.getSegment(values[n]) != curr_segment);
+  }
+  return outside_segment;
+}
+
+template size_t PointExtractor::extract<int16_t>(
+    const BasicVolumicData<int16_t> &,
+    const std::function<void(const DrawablePoint &)> &,
+    const BrickedVolume<int16_t> *) const;
+template size_t PointExtractor::extract<uint8_t>(
+    const BasicVolumicData<uint8_t> &,
+    const std::function<void(const DrawablePoint &)> &,
+    const BrickedVolume<uint8_t> *) const;
+template size_t PointExtractor::extract<float>(
+    const BasicVolumicData<float> &,
+    const std::function<void(const DrawablePoint &)> &,
+    const BrickedVolume<float> *) const;
+template std::vector<DrawablePoint>
+PointExtractor::extractPoints<int16_t>(const BasicVolumicData<int16_t> &,
+                                       const BrickedVolume<int16_t> *,
+                                       int) const;
+template std::vector<DrawablePoint>
+PointExtractor::extractPoints<int16_t>(const BasicVolumicData<int16_t> &,
+                                       const LabelVolume &, int) const;
+template std::vector<DrawablePoint>
+PointExtractor::extractPoints<uint8_t>(const BasicVolumicData<uint8_t> &,
+                                       const BrickedVolume<uint8_t> *,
+                                       int) const;
+template std::vector<DrawablePoint>
+PointExtractor::extractPoints<uint8_t>(const BasicVolumicData<uint8_t> &,
+                                       const LabelVolume &, int) const;
+template std::vector<DrawablePoint>
+PointExtractor::extractPoints<float>(const BasicVolumicData<float> &,
+                                     const BrickedVolume<float> *,
+                                     int) const;
+template std::vector<DrawablePoint>
+PointExtractor::extractPoints<float>(const BasicVolumicData<float> &,
+                                     const LabelVolume &, int) const;
+template size_t PointExtractor::extract<int16_t>(
+    OutOfCoreVolume<int16_t> &,
+    const std::function<void(const DrawablePoint &)> &) const;
+template size_t PointExtractor::extract<uint8_t>(
+    OutOfCoreVolume<uint8_t> &,
+    const std::function<void(const DrawablePoint &)> &) const;
+template size_t PointExtractor::extract<float>(
+    OutOfCoreVolume<float> &,
+    const std::function<void(const DrawablePoint &)> &) const;
@@ -0,0 +1,187 @@
+#ifndef POINT_EXTRACTOR_H
+#define POINT_EXTRACTOR_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <QVector3D>
+
+#include "bricked_volume.h"
+#include "compressed_volume.h"
+#include "label_volume.h"
+#include "out_of_core_volume.h"
+#include "volumic_data.h"
+#include "voxel_classifier.h"
+
+/// A point of the cloud extracted from a volume
+struct DrawablePoint {
+  QVector3D pos;
+  QVector3D color;
+  double a;
+};
+
+/// Converts the voxels of a volume to a point cloud
+///
+/// It does not depend on any widget, so that the same extraction is used by
+/// the 3D view and by the headless batch tool.
+class PointExtractor {
+public:
+  /// Voxels with a value in [threshold_min, threshold_max] are extracted
+  /// (ignored in color mode)
+  double threshold_min;
+  double threshold_max;
+  /// Only keep the voxels which have a neighbour in another segment
+  bool contours_mode;
+  /// Segment the voxels by tissue instead of using the threshold
+  bool color_mode;
+  /// Skip the layers below the active slice
+  bool hide_below;
+  /// Skip the layers above the active slice
+  bool hide_above;
+  /// Make the points of the active slice fully opaque
+  bool highlight;
+  /// The active slice, starting at 1 for the first layer
+  int active_slice;
+  /// The opacity of the points
+  double alpha;
+  /// When enabled, all points with a drawing color = 0 are hidden
+  bool hide_empty_points;
+  /// Neighbourhood of the contours detection: 6, 18 or 26 neighbours, 0 for
+  /// 6 in color mode and 26 otherwise
+  int contours_neighbourhood;
+  /// Extract with the kernel compiled for the current settings. The generic
+  /// kernel, which tests them for each voxel, is only kept to measure the
+  /// gain of the specialised ones.
+  bool specialised_kernels;
+
+  PointExtractor();
+
+  /// Call 'on_point' for each point extracted from 'volume', in storage
+  /// order, the layers which are not ready are skipped
+  /// The block summary of the volume is used to skip the blocks whose values
+  /// are all outside of the extracted range
+  /// Positions are centered on the volume and scaled to fit in [-1,1]
+  /// Return the number of points extracted
+  /// In contours mode, the layers are labelled with their segments and the
+  /// contours are found on the labels
+  /// - If 'bricked' is provided, it must be a copy of 'volume', the generic
+  ///   kernel reads the neighbourhoods of the voxels from it
+  /// Instantiated for all the voxel types of BasicVolumicData
+  template <typename T>
+  size_t extract(const BasicVolumicData<T> &volume,
+                 const std::function<void(const DrawablePoint &)> &on_point,
+                 const BrickedVolume<T> *bricked = nullptr) const;
+
+  /// Same as above on 'nb_threads' threads (one per core if <= 0), returning
+  /// the points in the same order
+  /// Each worker extracts whole layers to its own buffer, the buffers are
+  /// then concatenated in layer order at offsets given by a prefix sum of
+  /// their sizes
+  template <typename T>
+  std::vector<DrawablePoint>
+  extractPoints(const BasicVolumicData<T> &volume,
+                const BrickedVolume<T> *bricked = nullptr,
+                int nb_threads = 0) const;
+
+  /// Same as above reading the segments of the voxels from 'labels', which
+  /// covers all the layers of 'volume' and was computed with the current
+  /// threshold and color mode, so that the voxels are not classified again
+  template <typename T>
+  std::vector<DrawablePoint> extractPoints(const BasicVolumicData<T> &volume,
+                                           const LabelVolume &labels,
+                                           int nb_threads = 0) const;
+
+  /// Same as extract for a volume which is not in memory, it is read one slab
+  /// of bricks at a time so that the memory cap of 'volume' is respected
+  template <typename T>
+  size_t extract(OutOfCoreVolume<T> &volume,
+                 const std::function<void(const DrawablePoint &)> &on_point)
+      const;
+
+  /// Same as above for a compressed volume, which is decompressed one slab
+  /// of bricks at a time
+  size_t extract(const CompressedVolume &volume,
+                 const std::function<void(const DrawablePoint &)> &on_point)
+      const;
+
+private:
+  /// Range of layers to extract in a volume of 'depth' layers
+  void getLayerRange(int depth, int *layer_start, int *layer_end) const;
+
+  /// Classifier of the voxels of a volume whose window is
+  /// [win_min, win_max], for the current settings
+  template <typename T>
+  VoxelClassifier<T> createClassifier(double win_min, double win_max) const;
+
+  /// Labels of the layers of 'volume' needed to find the contours of its
+  /// layers [layer_start, layer_end), nullptr if the kernel used does not
+  /// need them
+  template <typename T>
+  std::unique_ptr<LabelVolume>
+  createLabels(const BasicVolumicData<T> &volume,
+               const VoxelClassifier<T> &classifier, int layer_start,
+               int layer_end, int nb_threads) const;
+
+  /// Value of the neighbourhood of the kernel testing the settings for each
+  /// voxel
+  static const int generic_kernel = -1;
+
+  /// Neighbourhood used to detect the contours, 6, 18 or 26
+  /// Throws std::invalid_argument if contours_neighbourhood is not valid
+  int getContoursNeighbourhood() const;
+
+  /// Implementation of extractPoints, 'labels' are needed in contours mode
+  template <typename T>
+  std::vector<DrawablePoint>
+  extractPointsInParallel(const BasicVolumicData<T> &volume,
+                          const BrickedVolume<T> *bricked,
+                          const VoxelClassifier<T> &classifier,
+                          const LabelVolume *labels, int nb_threads) const;
+
+  /// Call 'function' with an object of the KernelSettings type matching the
+  /// current settings, so that they are tested once per extraction instead
+  /// of once per voxel
+  template <typename Function>
+  void dispatchKernel(const Function &function) const;
+
+  /// Extract the layers [layer_start, layer_end) of a volume of
+  /// 'total_depth' layers, 'volume' holding its layers starting at
+  /// 'first_layer', with the kernel selected by dispatchKernel
+  /// - 'labels' are the ones given by createLabels, or labels covering all
+  ///   the layers. The voxels of segment 0 are skipped without reading them
+  ///   if they are provided.
+  template <typename T>
+  size_t extractLayers(
+      const BasicVolumicData<T> &volume, const BrickedVolume<T> *bricked,
+      const VoxelClassifier<T> &classifier, const LabelVolume *labels,
+      int first_layer, int total_depth, int layer_start, int layer_end,
+      const std::function<void(const DrawablePoint &)> &on_point) const;
+
+  /// Kernel of extractLayers
+  /// - 'Settings' is a KernelSettings. Its neighbourhood is 0 without
+  ///   contours, 6, 18 or 26 to keep the contours found in this
+  ///   neighbourhood on 'labels', generic_kernel to read the settings and
+  ///   test the neighbours of each voxel
+  /// - 'on_point' is called with each point, the kernel is compiled for its
+  ///   type so that appending to a buffer is inlined
+  template <typename T, typename Settings, typename Sink>
+  size_t extractLayersKernel(const BasicVolumicData<T> &volume,
+                             const BrickedVolume<T> *bricked,
+                             const VoxelClassifier<T> &classifier,
+                             const LabelVolume *labels, int first_layer,
+                             int total_depth, int layer_start, int layer_end,
+                             const Sink &on_point) const;
+
+  /// Does the voxel at (x, y, z) have one of its 'Neighbourhood' (6, 18 or
+  /// 26) neighbours outside of 'curr_segment'? Only used by the generic
+  /// kernel
+  template <typename T, int Neighbourhood>
+  bool connectivity(const BasicVolumicData<T> &volume,
+                    const BrickedVolume<T> *bricked,
+                    const VoxelClassifier<T> &classifier, int x, int y, int z,
+                    int curr_segment) const;
+};
+
+#endif // POINT_EXTRACTOR_H
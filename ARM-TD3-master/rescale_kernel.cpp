@@ -0,0 +1,288 @@
+#include "rescale_kernel.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+// The vector kernels are compiled for their own target and only called when
+// the processor supports it, the rest of the project keeps the default flags
+#if (defined(__GNUC__) || defined(__clang__)) &&                              \
+    (defined(__x86_64__) || defined(__i386__))
+#define RESCALE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+/// The conversion of the stored values, shared by all the kernels
+struct RescaleParams {
+  /// 8 or 16
+  int bits_allocated;
+  /// Keeps the 'bits_stored' low bits
+  int mask;
+  /// Sign bit of signed values, 0 for unsigned ones
+  int sign_bit;
+  double slope;
+  double intercept;
+  /// Is the conversion an integer shift (slope of 1, integer intercept)?
+  bool is_shift;
+  int shift;
+};
+
+/// Convert the pixels and reduce the min and max of the signed stored values
+typedef void (*RescaleKernel)(const void *stored, const RescaleParams &params,
+                              size_t nb_pixels, int16_t *voxels,
+                              int *min_value, int *max_value);
+
+/// Convert the pixels [begin, end), also used by the vector kernels for the
+/// pixels which do not fill a vector
+template <typename S>
+void rescaleRange(const S *stored, const RescaleParams &params, size_t begin,
+                  size_t end, int16_t *voxels, int *min_value,
+                  int *max_value) {
+  int local_min = *min_value;
+  int local_max = *max_value;
+  for (size_t i = begin; i < end; i++) {
+    // Subtracting the sign bit once flipped extends it to the high bits
+    int value = ((stored[i] & params.mask) ^ params.sign_bit) - params.sign_bit;
+    local_min = std::min(local_min, value);
+    local_max = std::max(local_max, value);
+    voxels[i] = VoxelTraits<int16_t>::fromHU(
+        value * params.slope + params.intercept, 0, 0);
+  }
+  *min_value = local_min;
+  *max_value = local_max;
+}
+
+void scalarKernel(const void *stored, const RescaleParams &params,
+                  size_t nb_pixels, int16_t *voxels, int *min_value,
+                  int *max_value) {
+  if (params.bits_allocated == 8)
+    rescaleRange((const uint8_t *)stored, params, 0, nb_pixels, voxels,
+                 min_value, max_value);
+  else
+    rescaleRange((const uint16_t *)stored, params, 0, nb_pixels, voxels,
+                 min_value, max_value);
+}
+
+#ifdef RESCALE_X86_KERNELS
+/// Load 16 stored values as two vectors of 8 int32
+__attribute__((target("avx2"))) inline void
+loadAvx2(const uint16_t *stored, __m256i *low, __m256i *high) {
+  __m256i raw = _mm256_loadu_si256((const __m256i *)stored);
+  *low = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(raw));
+  *high = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(raw, 1));
+}
+
+__attribute__((target("avx2"))) inline void
+loadAvx2(const uint8_t *stored, __m256i *low, __m256i *high) {
+  __m128i raw = _mm_loadu_si128((const __m128i *)stored);
+  *low = _mm256_cvtepu8_epi32(raw);
+  *high = _mm256_cvtepu8_epi32(_mm_srli_si128(raw, 8));
+}
+
+/// Convert 4 signed values to HU, rounded half away from zero like
+/// std::round and saturated to int16
+__attribute__((target("avx2"))) inline __m128i
+roundAvx2(__m128i values, __m256d slope, __m256d intercept) {
+  __m256d hu =
+      _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(values), slope), intercept);
+  __m256d truncated = _mm256_round_pd(hu, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+  // The fraction is exact, so the ties are detected exactly
+  __m256d fraction = _mm256_sub_pd(hu, truncated);
+  __m256d one = _mm256_set1_pd(1);
+  __m256d up = _mm256_and_pd(
+      _mm256_cmp_pd(fraction, _mm256_set1_pd(0.5), _CMP_GE_OQ), one);
+  __m256d down = _mm256_and_pd(
+      _mm256_cmp_pd(fraction, _mm256_set1_pd(-0.5), _CMP_LE_OQ), one);
+  __m256d rounded = _mm256_sub_pd(_mm256_add_pd(truncated, up), down);
+  rounded = _mm256_min_pd(_mm256_max_pd(rounded, _mm256_set1_pd(INT16_MIN)),
+                          _mm256_set1_pd(INT16_MAX));
+  return _mm256_cvttpd_epi32(rounded);
+}
+
+template <typename S>
+__attribute__((target("avx2"))) void
+rescaleAvx2(const S *stored, const RescaleParams &params, size_t nb_pixels,
+            int16_t *voxels, int *min_value, int *max_value) {
+  const __m256i mask = _mm256_set1_epi32(params.mask);
+  const __m256i sign_bit = _mm256_set1_epi32(params.sign_bit);
+  const __m256i shift = _mm256_set1_epi32(params.shift);
+  const __m256d slope = _mm256_set1_pd(params.slope);
+  const __m256d intercept = _mm256_set1_pd(params.intercept);
+  __m256i local_min = _mm256_set1_epi32(*min_value);
+  __m256i local_max = _mm256_set1_epi32(*max_value);
+  size_t i = 0;
+  for (; i + 16 <= nb_pixels; i += 16) {
+    __m256i values[2];
+    loadAvx2(stored + i, &values[0], &values[1]);
+    for (__m256i &v : values) {
+      v = _mm256_sub_epi32(
+          _mm256_xor_si256(_mm256_and_si256(v, mask), sign_bit), sign_bit);
+      local_min = _mm256_min_epi32(local_min, v);
+      local_max = _mm256_max_epi32(local_max, v);
+      if (params.is_shift) {
+        v = _mm256_add_epi32(v, shift);
+      } else {
+        __m128i low = roundAvx2(_mm256_castsi256_si128(v), slope, intercept);
+        __m128i high =
+            roundAvx2(_mm256_extracti128_si256(v, 1), slope, intercept);
+        v = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+      }
+    }
+    // packs works on each 128 bits lane, the permutation restores the order
+    __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packs_epi32(values[0], values[1]), 0xd8);
+    _mm256_storeu_si256((__m256i *)(voxels + i), packed);
+  }
+  int mins[8], maxs[8];
+  _mm256_storeu_si256((__m256i *)mins, local_min);
+  _mm256_storeu_si256((__m256i *)maxs, local_max);
+  *min_value = *std::min_element(mins, mins + 8);
+  *max_value = *std::max_element(maxs, maxs + 8);
+  rescaleRange(stored, params, i, nb_pixels, voxels, min_value, max_value);
+}
+
+void avx2Kernel(const void *stored, const RescaleParams &params,
+                size_t nb_pixels, int16_t *voxels, int *min_value,
+                int *max_value) {
+  if (params.bits_allocated == 8)
+    rescaleAvx2((const uint8_t *)stored, params, nb_pixels, voxels,
+                min_value, max_value);
+  else
+    rescaleAvx2((const uint16_t *)stored, params, nb_pixels, voxels,
+                min_value, max_value);
+}
+
+/// Load 8 stored values as two vectors of 4 int32
+__attribute__((target("sse4.1"))) inline void
+loadSse41(const uint16_t *stored, __m128i *low, __m128i *high) {
+  __m128i raw = _mm_loadu_si128((const __m128i *)stored);
+  *low = _mm_cvtepu16_epi32(raw);
+  *high = _mm_cvtepu16_epi32(_mm_srli_si128(raw, 8));
+}
+
+__attribute__((target("sse4.1"))) inline void
+loadSse41(const uint8_t *stored, __m128i *low, __m128i *high) {
+  __m128i raw = _mm_loadl_epi64((const __m128i *)stored);
+  *low = _mm_cvtepu8_epi32(raw);
+  *high = _mm_cvtepu8_epi32(_mm_srli_si128(raw, 4));
+}
+
+/// Same as roundAvx2 for the 2 low values of 'values', the result being in
+/// the 2 low int32
+__attribute__((target("sse4.1"))) inline __m128i
+roundSse41(__m128i values, __m128d slope, __m128d intercept) {
+  __m128d hu = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(values), slope), intercept);
+  __m128d truncated = _mm_round_pd(hu, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+  __m128d fraction = _mm_sub_pd(hu, truncated);
+  __m128d one = _mm_set1_pd(1);
+  __m128d up = _mm_and_pd(_mm_cmpge_pd(fraction, _mm_set1_pd(0.5)), one);
+  __m128d down = _mm_and_pd(_mm_cmple_pd(fraction, _mm_set1_pd(-0.5)), one);
+  __m128d rounded = _mm_sub_pd(_mm_add_pd(truncated, up), down);
+  rounded = _mm_min_pd(_mm_max_pd(rounded, _mm_set1_pd(INT16_MIN)),
+                       _mm_set1_pd(INT16_MAX));
+  return _mm_cvttpd_epi32(rounded);
+}
+
+template <typename S>
+__attribute__((target("sse4.1"))) void
+rescaleSse41(const S *stored, const RescaleParams &params, size_t nb_pixels,
+             int16_t *voxels, int *min_value, int *max_value) {
+  const __m128i mask = _mm_set1_epi32(params.mask);
+  const __m128i sign_bit = _mm_set1_epi32(params.sign_bit);
+  const __m128i shift = _mm_set1_epi32(params.shift);
+  const __m128d slope = _mm_set1_pd(params.slope);
+  const __m128d intercept = _mm_set1_pd(params.intercept);
+  __m128i local_min = _mm_set1_epi32(*min_value);
+  __m128i local_max = _mm_set1_epi32(*max_value);
+  size_t i = 0;
+  for (; i + 8 <= nb_pixels; i += 8) {
+    __m128i values[2];
+    loadSse41(stored + i, &values[0], &values[1]);
+    for (__m128i &v : values) {
+      v = _mm_sub_epi32(_mm_xor_si128(_mm_and_si128(v, mask), sign_bit),
+                        sign_bit);
+      local_min = _mm_min_epi32(local_min, v);
+      local_max = _mm_max_epi32(local_max, v);
+      if (params.is_shift)
+        v = _mm_add_epi32(v, shift);
+      else
+        v = _mm_unpacklo_epi64(
+            roundSse41(v, slope, intercept),
+            roundSse41(_mm_srli_si128(v, 8), slope, intercept));
+    }
+    _mm_storeu_si128((__m128i *)(voxels + i),
+                     _mm_packs_epi32(values[0], values[1]));
+  }
+  int mins[4], maxs[4];
+  _mm_storeu_si128((__m128i *)mins, local_min);
+  _mm_storeu_si128((__m128i *)maxs, local_max);
+  *min_value = *std::min_element(mins, mins + 4);
+  *max_value = *std::max_element(maxs, maxs + 4);
+  rescaleRange(stored, params, i, nb_pixels, voxels, min_value, max_value);
+}
+
+void sse41Kernel(const void *stored, const RescaleParams &params,
+                 size_t nb_pixels, int16_t *voxels, int *min_value,
+                 int *max_value) {
+  if (params.bits_allocated == 8)
+    rescaleSse41((const uint8_t *)stored, params, nb_pixels, voxels,
+                 min_value, max_value);
+  else
+    rescaleSse41((const uint16_t *)stored, params, nb_pixels, voxels,
+                 min_value, max_value);
+}
+#endif
+
+struct KernelChoice {
+  RescaleKernel kernel;
+  const char *name;
+};
+
+KernelChoice selectKernel() {
+#ifdef RESCALE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return {avx2Kernel, "avx2"};
+  if (__builtin_cpu_supports("sse4.1"))
+    return {sse41Kernel, "sse4.1"};
+#endif
+  return {scalarKernel, "scalar"};
+}
+
+/// The kernel is selected once, on the first use
+const KernelChoice &getKernel() {
+  static const KernelChoice choice = selectKernel();
+  return choice;
+}
+} // namespace
+
+void rescaleStoredToHU(const void *stored, const StoredPixelFormat &format,
+                       size_t nb_pixels, int16_t *voxels, double *min_hu,
+                       double *max_hu) {
+  RescaleParams params;
+  params.bits_allocated = format.bits_allocated;
+  params.mask = (1 << format.bits_stored) - 1;
+  params.sign_bit = format.is_signed ? 1 << (format.bits_stored - 1) : 0;
+  params.slope = format.slope;
+  params.intercept = format.intercept;
+  // Stored values and intercept stay far from the int32 limits
+  params.is_shift = format.slope == 1 &&
+                    format.intercept == std::floor(format.intercept) &&
+                    std::abs(format.intercept) <= 65536;
+  params.shift = params.is_shift ? (int)format.intercept : 0;
+
+  int min_value = INT_MAX;
+  int max_value = INT_MIN;
+  getKernel().kernel(stored, params, nb_pixels, voxels, &min_value,
+                     &max_value);
+  if (nb_pixels == 0)
+    return;
+  // The rescale is monotonic, the extreme values give the extreme HU
+  double hu_a = min_value * format.slope + format.intercept;
+  double hu_b = max_value * format.slope + format.intercept;
+  *min_hu = std::min(*min_hu, std::min(hu_a, hu_b));
+  *max_hu = std::max(*max_hu, std::max(hu_a, hu_b));
+}
+
+const char *getRescaleKernelName() { return getKernel().name; }
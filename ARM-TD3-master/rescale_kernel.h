@@ -0,0 +1,25 @@
+#ifndef RESCALE_KERNEL_H
+#define RESCALE_KERNEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "volumic_data.h"
+
+/// Modality LUT of the decoded slices: convert 'nb_pixels' values stored as
+/// described by 'format' (8 or 16 bits allocated) to Hounsfield units rounded
+/// to the nearest integer and saturated to int16, reducing the min and max
+/// of the values in Hounsfield units
+///
+/// The result is the same as VoxelTraits<int16_t>::fromHU applied to
+/// 'value * slope + intercept'. The AVX2 or SSE4.1 kernel is used when the
+/// processor supports it, a scalar one otherwise.
+void rescaleStoredToHU(const void *stored, const StoredPixelFormat &format,
+                       size_t nb_pixels, int16_t *voxels, double *min_hu,
+                       double *max_hu);
+
+/// Name of the kernel used by rescaleStoredToHU: "avx2", "sse4.1" or
+/// "scalar"
+const char *getRescaleKernelName();
+
+#endif // RESCALE_KERNEL_H
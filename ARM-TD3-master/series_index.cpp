@@ -0,0 +1,210 @@
+#include "series_index.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <QDateTime>
+#include <QDirIterator>
+#include <QFileInfo>
+
+#include "parallel.h"
+
+namespace {
+const std::string index_header = "# dicom_viewer series index v4";
+const std::string index_name = ".dicom_viewer_index";
+const std::string cache_dir_name = ".dicom_viewer_cache";
+
+/// Update the FNV-1a hash 'hash' with 'str'
+uint64_t hashString(uint64_t hash, const std::string &str) {
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+} // namespace
+
+SeriesIndex::SeriesIndex(const std::string &root_dir)
+    : nb_parsed_files(0), nb_cached_files(0), root_dir(root_dir) {}
+
+std::string SeriesIndex::getIndexPath() const {
+  return root_dir + "/" + index_name;
+}
+
+std::string SeriesIndex::getCacheDir() const {
+  return root_dir + "/" + cache_dir_name;
+}
+
+void SeriesIndex::update(int nb_threads) {
+  std::map<std::string, Entry> old_entries = readIndex();
+  // Listing all the files of the tree, reusing unchanged entries
+  std::map<std::string, Entry> entries;
+  std::vector<std::string> to_parse;
+  QDirIterator it(QString::fromStdString(root_dir), QDir::Files,
+                  QDirIterator::Subdirectories);
+  while (it.hasNext()) {
+    std::string path = it.next().toStdString();
+    QFileInfo file_info = it.fileInfo();
+    if (file_info.fileName().toStdString() == index_name ||
+        path.find("/" + cache_dir_name + "/") != std::string::npos)
+      continue;
+    Entry entry;
+    entry.mtime = file_info.lastModified().toMSecsSinceEpoch();
+    entry.size = file_info.size();
+    auto old_it = old_entries.find(path);
+    if (old_it != old_entries.end() && old_it->second.mtime == entry.mtime &&
+        old_it->second.size == entry.size) {
+      entries[path] = old_it->second;
+    } else {
+      entry.is_dicom = false;
+      entries[path] = entry;
+      to_parse.push_back(path);
+    }
+  }
+  nb_parsed_files = to_parse.size();
+  nb_cached_files = entries.size() - to_parse.size();
+
+  // Reading the headers of new and modified files
+  std::vector<Entry *> to_fill;
+  for (const std::string &path : to_parse)
+    to_fill.push_back(&entries.at(path));
+  parallelFor(
+      0, to_parse.size(),
+      [&](size_t idx) {
+        try {
+          to_fill[idx]->frames = DicomCollection::scanFile(to_parse[idx]);
+          to_fill[idx]->is_dicom = !to_fill[idx]->frames.empty() &&
+                                 to_fill[idx]->frames[0].series_uid != "";
+        } catch (const DicomCollectionError &) {
+          to_fill[idx]->is_dicom = false;
+        }
+      },
+      nb_threads);
+  writeIndex(entries);
+
+  // Grouping files by series
+  series.clear();
+  for (const auto &entry : entries) {
+    if (!entry.second.is_dicom)
+      continue;
+    const DicomSliceInfo &info = entry.second.frames[0];
+    DicomSeries &s = series[info.series_uid];
+    if (s.slices.empty()) {
+      s.study_uid = info.study_uid;
+      s.series_uid = info.series_uid;
+      s.patient_name = info.patient_name;
+      s.signature = 14695981039346656037ULL;
+      s.cache_path = getCacheDir() + "/" + info.series_uid + ".vol";
+    }
+    s.slices.insert(s.slices.end(), entry.second.frames.begin(),
+                    entry.second.frames.end());
+    std::ostringstream oss;
+    oss << entry.first << "\t" << entry.second.size << "\t"
+        << entry.second.mtime << "\n";
+    s.signature = hashString(s.signature, oss.str());
+  }
+  for (auto &entry : series) {
+    std::vector<DicomSliceInfo> &slices = entry.second.slices;
+    std::sort(slices.begin(), slices.end(),
+              [](const DicomSliceInfo &a, const DicomSliceInfo &b) {
+                return a.instance < b.instance;
+              });
+  }
+}
+
+std::map<std::string, SeriesIndex::Entry> SeriesIndex::readIndex() const {
+  std::map<std::string, Entry> entries;
+  std::ifstream in(getIndexPath());
+  std::string line;
+  if (!std::getline(in, line) || line != index_header)
+    return entries;
+  while (std::getline(in, line)) {
+    std::istringstream line_iss(line);
+    std::vector<std::string> fields;
+    std::string field;
+    while (std::getline(line_iss, field, '\t'))
+      fields.push_back(field);
+    // The last field, the transfer syntax, is empty for non-Dicom files
+    if (!line.empty() && line.back() == '\t')
+      fields.push_back("");
+    if (fields.size() != 21) {
+      std::cerr << "Ignoring invalid line in " << getIndexPath() << std::endl;
+      continue;
+    }
+    try {
+      Entry entry = parseEntry(fields);
+      // The frames of a multi-frame file are stored on consecutive lines
+      auto it = entries.find(fields[0]);
+      if (it != entries.end() && it->second.is_dicom && entry.is_dicom)
+        it->second.frames.push_back(entry.frames[0]);
+      else
+        entries[fields[0]] = entry;
+    } catch (const std::exception &) {
+      std::cerr << "Ignoring invalid line in " << getIndexPath() << std::endl;
+    }
+  }
+  return entries;
+}
+
+SeriesIndex::Entry
+SeriesIndex::parseEntry(const std::vector<std::string> &fields) {
+  Entry entry;
+  entry.frames.resize(1);
+  DicomSliceInfo &info = entry.frames[0];
+  info.path = fields[0];
+  entry.mtime = std::stoll(fields[1]);
+  entry.size = std::stoll(fields[2]);
+  entry.is_dicom = fields[3] == "1";
+  info.patient_name = fields[4];
+  info.study_uid = fields[5];
+  info.series_uid = fields[6];
+  info.instance = std::stoi(fields[7]);
+  info.frame = std::stoi(fields[8]);
+  info.pixel_spacing = {std::stod(fields[9]), std::stod(fields[10])};
+  info.position = {std::stod(fields[11]), std::stod(fields[12]),
+                   std::stod(fields[13])};
+  info.width = std::stoi(fields[14]);
+  info.height = std::stoi(fields[15]);
+  info.slope = std::stod(fields[16]);
+  info.intercept = std::stod(fields[17]);
+  info.window_center = std::stod(fields[18]);
+  info.window_width = std::stod(fields[19]);
+  info.transfer_syntax = fields[20];
+  return entry;
+}
+
+void SeriesIndex::writeIndex(
+    const std::map<std::string, Entry> &entries) const {
+  std::ofstream out(getIndexPath());
+  if (!out) {
+    std::cerr << "Failed to write series index: " << getIndexPath()
+              << std::endl;
+    return;
+  }
+  // Full precision is required since spacings are compared exactly
+  out << std::setprecision(17);
+  out << index_header << "\n";
+  for (const auto &item : entries) {
+    const Entry &entry = item.second;
+    if (!entry.is_dicom) {
+      out << item.first << "\t" << entry.mtime << "\t" << entry.size
+          << "\t0\t\t\t\t0\t0\t0\t0\t0\t0\t0\t0\t0\t0\t0\t0\t0\t\n";
+      continue;
+    }
+    // One line per frame
+    for (const DicomSliceInfo &info : entry.frames) {
+      out << item.first << "\t" << entry.mtime << "\t" << entry.size
+          << "\t1\t" << info.patient_name << "\t" << info.study_uid << "\t"
+          << info.series_uid << "\t" << info.instance << "\t" << info.frame
+          << "\t" << info.pixel_spacing[0] << "\t" << info.pixel_spacing[1]
+          << "\t" << info.position[0] << "\t" << info.position[1] << "\t"
+          << info.position[2] << "\t" << info.width << "\t" << info.height
+          << "\t" << info.slope << "\t" << info.intercept << "\t"
+          << info.window_center << "\t" << info.window_width << "\t"
+          << info.transfer_syntax << "\n";
+    }
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef SERIES_INDEX_H
+#define SERIES_INDEX_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "dicom_collection.h"
+
+/// The files of a directory tree sharing the same SeriesInstanceUID
+struct DicomSeries {
+  std::string study_uid;
+  std::string series_uid;
+  std::string patient_name;
+  std::vector<DicomSliceInfo> slices;
+  /// Hash of the paths, sizes and modification dates of the files, it
+  /// changes whenever a file of the series is added, removed or modified
+  uint64_t signature;
+  /// Where the decoded volume of the series is cached
+  std::string cache_path;
+};
+
+/// A persistent index of all the Dicom series found in a directory tree
+///
+/// The headers read while crawling are stored in a file at the root of the
+/// tree, so that files which did not change since the last crawl (same size
+/// and modification time) are not parsed again.
+class SeriesIndex {
+public:
+  /// The series of the tree, indexed by SeriesInstanceUID
+  std::map<std::string, DicomSeries> series;
+
+  /// Number of files parsed during the last call to 'update'
+  int nb_parsed_files;
+  /// Number of files reused from the on-disk index during the last call to
+  /// 'update'
+  int nb_cached_files;
+
+  SeriesIndex(const std::string &root_dir);
+
+  /// Crawl the directory tree, parsing new and modified files with
+  /// 'nb_threads' workers (one per core if <= 0), then save the index
+  void update(int nb_threads = 0);
+
+  /// Path of the on-disk index for this tree
+  std::string getIndexPath() const;
+
+  /// Directory containing the volume caches of the series of this tree
+  std::string getCacheDir() const;
+
+private:
+  /// An indexed file with the properties used to detect modifications
+  struct Entry {
+    /// One element per frame of the file
+    std::vector<DicomSliceInfo> frames;
+    long long mtime;
+    long long size;
+    /// False for the files which could not be parsed as Dicom images, they
+    /// are indexed anyway to avoid parsing them at each crawl
+    bool is_dicom;
+  };
+
+  std::string root_dir;
+
+  /// Read the on-disk index, returns an empty map if there is none
+  std::map<std::string, Entry> readIndex() const;
+
+  /// Build an entry holding a single frame from the fields of a line of the
+  /// on-disk index
+  static Entry parseEntry(const std::vector<std::string> &fields);
+
+  /// Write 'entries' to the on-disk index, failures are only reported on
+  /// std::cerr since the index is a pure optimization
+  void writeIndex(const std::map<std::string, Entry> &entries) const;
+};
+
+#endif // SERIES_INDEX_H
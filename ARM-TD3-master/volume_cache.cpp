@@ -0,0 +1,137 @@
+#include "volume_cache.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <QFile>
+
+namespace {
+const char cache_magic[8] = {'D', 'V', 'V', 'O', 'L', 'U', 'M', 'E'};
+const uint32_t cache_version = 2;
+/// Identifier of the type of the voxels of VolumicData, int16 Hounsfield
+/// units
+const int32_t cache_voxel_type = 1;
+/// Alignment of the voxels inside the file [bytes]
+const uint64_t cache_alignment = 4096;
+
+/// The header written at the beginning of cache files
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  /// Size of a voxel [bytes]
+  uint32_t voxel_size;
+  int32_t width;
+  int32_t height;
+  int32_t depth;
+  int32_t voxel_type;
+  double pixel_width;
+  double pixel_height;
+  double slice_spacing;
+  double win_min;
+  double win_max;
+  uint64_t signature;
+  double min_value;
+  double max_value;
+  /// Offset of the first voxel in the file [bytes]
+  uint64_t data_offset;
+};
+} // namespace
+
+bool saveVolumeCache(const VolumicData &volume, const VolumeCacheInfo &info,
+                     const std::string &path) {
+  CacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+  header.version = cache_version;
+  header.voxel_size = sizeof(VolumicData::Voxel);
+  header.voxel_type = cache_voxel_type;
+  header.width = volume.width;
+  header.height = volume.height;
+  header.depth = volume.depth;
+  header.pixel_width = volume.pixel_width;
+  header.pixel_height = volume.pixel_height;
+  header.slice_spacing = volume.slice_spacing;
+  header.win_min = volume.win_min;
+  header.win_max = volume.win_max;
+  header.signature = info.signature;
+  header.min_value = info.min_value;
+  header.max_value = info.max_value;
+  header.data_offset = cache_alignment;
+
+  // Writing to a temporary file first, so that an interrupted write never
+  // leaves a truncated cache behind
+  std::string tmp_path = path + ".tmp";
+  QFile file(QString::fromStdString(tmp_path));
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    std::cerr << "Failed to write volume cache " << tmp_path << ": "
+              << file.errorString().toStdString() << std::endl;
+    return false;
+  }
+  std::vector<char> padding(header.data_offset - sizeof(header), 0);
+  qint64 layer_size = (qint64)volume.width * volume.height * header.voxel_size;
+  bool success =
+      file.write((const char *)&header, sizeof(header)) == sizeof(header) &&
+      file.write(padding.data(), padding.size()) == (qint64)padding.size();
+  for (int layer = 0; success && layer < volume.depth; layer++)
+    success = file.write((const char *)volume.getLayerData(layer),
+                         layer_size) == layer_size;
+  file.close();
+  if (!success) {
+    std::cerr << "Failed to write volume cache " << tmp_path << std::endl;
+    QFile::remove(QString::fromStdString(tmp_path));
+    return false;
+  }
+  QFile::remove(QString::fromStdString(path));
+  return QFile::rename(QString::fromStdString(tmp_path),
+                       QString::fromStdString(path));
+}
+
+std::unique_ptr<VolumicData> openVolumeCache(const std::string &path,
+                                             uint64_t signature,
+                                             VolumeCacheInfo *info) {
+  std::shared_ptr<QFile> file(new QFile(QString::fromStdString(path)));
+  if (!file->open(QIODevice::ReadOnly))
+    return nullptr;
+  CacheHeader header;
+  if (file->read((char *)&header, sizeof(header)) != sizeof(header) ||
+      std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 ||
+      header.version != cache_version ||
+      header.voxel_size != sizeof(VolumicData::Voxel) ||
+      header.voxel_type != cache_voxel_type || header.signature != signature)
+    return nullptr;
+  std::unique_ptr<VolumicData> volume(new VolumicData());
+  volume->width = header.width;
+  volume->height = header.height;
+  volume->depth = header.depth;
+  qint64 data_size = volume->getNbVoxels() * header.voxel_size;
+  if (file->size() < (qint64)header.data_offset + data_size) {
+    std::cerr << "Truncated volume cache: " << path << std::endl;
+    return nullptr;
+  }
+  // A private mapping is used, so that modifying the volume never alters the
+  // cache
+  uchar *mapped = file->map(header.data_offset, data_size,
+                            QFileDevice::MapPrivateOption);
+  if (mapped == nullptr) {
+    std::cerr << "Failed to map volume cache " << path << ": "
+              << file->errorString().toStdString() << std::endl;
+    return nullptr;
+  }
+  // The mapping lives as long as the file object
+  std::shared_ptr<void> owner(mapped, [file](void *ptr) {
+    file->unmap((uchar *)ptr);
+  });
+  volume->ready_layers = std::vector<std::atomic<bool>>(volume->depth);
+  volume->setExternalData((VolumicData::Voxel *)mapped, owner);
+  volume->pixel_width = header.pixel_width;
+  volume->pixel_height = header.pixel_height;
+  volume->slice_spacing = header.slice_spacing;
+  volume->win_min = header.win_min;
+  volume->win_max = header.win_max;
+  if (info != nullptr) {
+    info->signature = header.signature;
+    info->min_value = header.min_value;
+    info->max_value = header.max_value;
+  }
+  return volume;
+}
@@ -0,0 +1,39 @@
+#ifndef VOLUME_CACHE_H
+#define VOLUME_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "volumic_data.h"
+
+/// Native on-disk representation of a decoded VolumicData
+///
+/// A cache file is made of a fixed size header followed by the raw voxels,
+/// stored exactly as in VolumicData::data. The voxels start on a page
+/// boundary, so that the file can be mapped and used without any copy.
+
+/// Properties of the collection stored along with the voxels
+struct VolumeCacheInfo {
+  /// Identifies the source files (paths, sizes and modification dates), a
+  /// cache is only used if its signature matches the expected one
+  uint64_t signature;
+  /// Minimal value used among the whole collection
+  double min_value;
+  /// Maximal value used among the whole collection
+  double max_value;
+};
+
+/// Write 'volume' to 'path', all its layers must be ready
+/// On failure, return false and print the reason on std::cerr
+bool saveVolumeCache(const VolumicData &volume, const VolumeCacheInfo &info,
+                     const std::string &path);
+
+/// Map the cache file at 'path' into a new VolumicData without copying voxels
+/// Return nullptr if there is no valid cache at 'path' for 'signature'
+/// - 'info' receives the properties stored in the cache
+std::unique_ptr<VolumicData> openVolumeCache(const std::string &path,
+                                             uint64_t signature,
+                                             VolumeCacheInfo *info);
+
+#endif // VOLUME_CACHE_H
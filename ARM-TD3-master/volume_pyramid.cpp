@@ -0,0 +1,111 @@
+#include "volume_pyramid.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "parallel.h"
+
+template <typename T>
+VolumePyramid<T>::VolumePyramid(
+    std::shared_ptr<const BasicVolumicData<T>> base, int nb_levels,
+    PyramidReduction reduction, int nb_threads)
+    : base(base), reduction(reduction) {
+  const BasicVolumicData<T> *src = base.get();
+  for (int level = 1; level < nb_levels; level++) {
+    if (src->width <= 1 && src->height <= 1 && src->depth <= 1)
+      break;
+    std::unique_ptr<BasicVolumicData<T>> dst(new BasicVolumicData<T>(
+        (src->width + 1) / 2, (src->height + 1) / 2, (src->depth + 1) / 2,
+        src->win_min, src->win_max));
+    dst->pixel_width = src->pixel_width * src->width / dst->width;
+    dst->pixel_height = src->pixel_height * src->height / dst->height;
+    dst->slice_spacing = src->slice_spacing * src->depth / dst->depth;
+    // Each level only depends on the previous one, its layers are
+    // independent
+    BasicVolumicData<T> *dst_ptr = dst.get();
+    parallelFor(
+        0, dst->depth,
+        [this, src, dst_ptr](size_t layer) {
+          reduceLayer(*src, dst_ptr, layer);
+        },
+        nb_threads);
+    levels.push_back(std::move(dst));
+    src = levels.back().get();
+  }
+}
+
+template <typename T> int VolumePyramid<T>::getNbLevels() const {
+  return 1 + (int)levels.size();
+}
+
+template <typename T>
+const BasicVolumicData<T> &VolumePyramid<T>::getLevel(int level) const {
+  if (level < 0 || level >= getNbLevels())
+    throw std::out_of_range("Invalid pyramid level: " +
+                            std::to_string(level));
+  return level == 0 ? *base : *levels[level - 1];
+}
+
+template <typename T>
+void VolumePyramid<T>::reduceLayer(const BasicVolumicData<T> &src,
+                                   BasicVolumicData<T> *dst,
+                                   int layer) const {
+  // Missing layers are left out as if empty
+  int src_layers[2];
+  int nb_src_layers = 0;
+  for (int z = 2 * layer; z < std::min(2 * layer + 2, src.depth); z++)
+    if (src.isLayerReady(z))
+      src_layers[nb_src_layers++] = z;
+  if (nb_src_layers == 0)
+    return;
+  std::vector<T> voxels((size_t)dst->width * dst->height);
+  T values[8];
+  for (int row = 0; row < dst->height; row++) {
+    int src_row_end = std::min(2 * row + 2, src.height);
+    for (int col = 0; col < dst->width; col++) {
+      int src_col_end = std::min(2 * col + 2, src.width);
+      int nb_values = 0;
+      for (int i = 0; i < nb_src_layers; i++)
+        for (int y = 2 * row; y < src_row_end; y++)
+          for (int x = 2 * col; x < src_col_end; x++)
+            values[nb_values++] = src.getValue(x, y, src_layers[i]);
+      voxels[col + (size_t)dst->width * row] =
+          reduce(values, nb_values, src.win_min, src.win_max);
+    }
+  }
+  dst->setLayer(voxels.data(), layer);
+  dst->setLayerReady(layer);
+}
+
+template <typename T>
+T VolumePyramid<T>::reduce(const T *values, int nb_values, double win_min,
+                           double win_max) const {
+  switch (reduction) {
+  case PyramidReduction::Max:
+    return *std::max_element(values, values + nb_values);
+  case PyramidReduction::Mean: {
+    double sum = 0;
+    for (int i = 0; i < nb_values; i++)
+      sum += VoxelTraits<T>::toHU(values[i], win_min, win_max);
+    return VoxelTraits<T>::fromHU(sum / nb_values, win_min, win_max);
+  }
+  case PyramidReduction::Majority: {
+    // At most 8 values, counting the occurrences of each is cheap enough
+    int best_idx = 0;
+    int best_count = 0;
+    for (int i = 0; i < nb_values; i++) {
+      int count = (int)std::count(values + i, values + nb_values, values[i]);
+      if (count > best_count) {
+        best_idx = i;
+        best_count = count;
+      }
+    }
+    return values[best_idx];
+  }
+  }
+  throw std::logic_error("Unknown pyramid reduction");
+}
+
+template class VolumePyramid<int16_t>;
+template class VolumePyramid<uint8_t>;
+template class VolumePyramid<float>;
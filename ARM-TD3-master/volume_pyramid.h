@@ -0,0 +1,56 @@
+#ifndef VOLUME_PYRAMID_H
+#define VOLUME_PYRAMID_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "volumic_data.h"
+
+/// How the up to 8 voxels covered by a voxel of a coarser level are combined
+enum class PyramidReduction {
+  /// Highest value, thin bright structures such as bones are preserved
+  Max,
+  /// Average value in Hounsfield units
+  Mean,
+  /// Most frequent value, for volumes of labels
+  Majority
+};
+
+/// Levels of detail of a volume, each level halving the resolution of the
+/// previous one along every axis
+///
+/// Level 0 is the base volume itself, which is shared and not copied.
+/// Coarser levels keep the physical extent of the base volume,
+/// so that the point clouds extracted from any level overlap.
+template <typename T> class VolumePyramid {
+public:
+  /// Build up to 'nb_levels' levels (including the base) from 'base'
+  /// - The layers of 'base' which are not ready, such as missing instances,
+  ///   are left out. A layer of a coarser level is only ready when one of
+  ///   its source layers is.
+  /// - Levels stop once the volume is reduced to a single voxel
+  /// - The layers of each level are reduced on 'nb_threads' threads, <= 0
+  ///   using one thread per core
+  VolumePyramid(std::shared_ptr<const BasicVolumicData<T>> base,
+                int nb_levels, PyramidReduction reduction,
+                int nb_threads = 0);
+
+  int getNbLevels() const;
+  const BasicVolumicData<T> &getLevel(int level) const;
+
+private:
+  std::shared_ptr<const BasicVolumicData<T>> base;
+  /// Levels 1 and above
+  std::vector<std::unique_ptr<BasicVolumicData<T>>> levels;
+  PyramidReduction reduction;
+
+  /// Fill 'layer' of 'dst' from the 2 matching layers of 'src'
+  void reduceLayer(const BasicVolumicData<T> &src, BasicVolumicData<T> *dst,
+                   int layer) const;
+  /// Combine 'nb_values' voxels according to 'reduction'
+  T reduce(const T *values, int nb_values, double win_min,
+           double win_max) const;
+};
+
+#endif // VOLUME_PYRAMID_H
@@ -1,61 +1,324 @@
 #include "volumic_data.h"
 
+#include <algorithm>
 #include <stdexcept>
 
-#define range(value, min, max) value >= min && value < max 
+#include "parallel.h"
+#include "rescale_kernel.h"
 
-VolumicData::VolumicData()
-    : width(-1), height(-1), depth(-1), pixel_width(-1), pixel_height(-1),
-      slice_spacing(0) {}
+#define range(value, min, max) value >= min && value < max
+
+namespace {
+/// Convert stored values of type S (uint8_t or uint16_t) to voxels
+template <typename S, typename T>
+void rescaleStored(const S *stored, const StoredPixelFormat &format,
+                   size_t nb_pixels, double win_min, double win_max,
+                   T *voxels, double *min_hu, double *max_hu) {
+  // Only the 'bits_stored' low bits are significant, the highest of them
+  // being the sign bit of signed values
+  const int mask = (1 << format.bits_stored) - 1;
+  const int sign_bit = format.is_signed ? 1 << (format.bits_stored - 1) : 0;
+  double local_min = *min_hu;
+  double local_max = *max_hu;
+  for (size_t i = 0; i < nb_pixels; i++) {
+    int value = stored[i] & mask;
+    if (value & sign_bit)
+      value -= mask + 1;
+    double hu = value * format.slope + format.intercept;
+    local_min = std::min(local_min, hu);
+    local_max = std::max(local_max, hu);
+    voxels[i] = VoxelTraits<T>::fromHU(hu, win_min, win_max);
+  }
+  *min_hu = local_min;
+  *max_hu = local_max;
+}
 
-VolumicData::VolumicData(int W, int H, int D, double min, double max, double I)
-    : data(W * H * D), width(W), height(H), depth(D), win_min(min), win_max(max), intercept(I) {}
+/// HU voxels go through the vectorised modality LUT
+void rescaleToVoxels(const void *stored, const StoredPixelFormat &format,
+                     size_t nb_pixels, double, double, int16_t *voxels,
+                     double *min_hu, double *max_hu) {
+  rescaleStoredToHU(stored, format, nb_pixels, voxels, min_hu, max_hu);
+}
+
+/// Windowed and float voxels are converted one at a time
+template <typename T>
+void rescaleToVoxels(const void *stored, const StoredPixelFormat &format,
+                     size_t nb_pixels, double win_min, double win_max,
+                     T *voxels, double *min_hu, double *max_hu) {
+  if (format.bits_allocated == 8)
+    rescaleStored((const uint8_t *)stored, format, nb_pixels, win_min,
+                  win_max, voxels, min_hu, max_hu);
+  else
+    rescaleStored((const uint16_t *)stored, format, nb_pixels, win_min,
+                  win_max, voxels, min_hu, max_hu);
+}
 
-VolumicData::VolumicData(const VolumicData &other)
-    : data(other.data), width(other.width), height(other.height),
-      depth(other.depth), pixel_width(other.pixel_width),
-      pixel_height(other.pixel_height), slice_spacing(other.slice_spacing) {}
+/// HU voxels are counted directly
+Histogram computeHistogram(const int16_t *voxels, size_t nb_voxels, double,
+                           double) {
+  Histogram histogram;
+  histogram.add(voxels, nb_voxels);
+  return histogram;
+}
 
-VolumicData::~VolumicData() {}
+/// Histogram of voxels of type T, rounded to integer HU
+template <typename T>
+Histogram computeHistogram(const T *voxels, size_t nb_voxels, double win_min,
+                           double win_max) {
+  std::vector<int16_t> hu(nb_voxels);
+  for (size_t i = 0; i < nb_voxels; i++)
+    hu[i] = VoxelTraits<int16_t>::fromHU(
+        VoxelTraits<T>::toHU(voxels[i], win_min, win_max), 0, 0);
+  return computeHistogram(hu.data(), nb_voxels, 0, 0);
+}
+} // namespace
+
+template <typename T>
+void rescalePixels(const void *stored, const StoredPixelFormat &format,
+                   size_t nb_pixels, double win_min, double win_max,
+                   T *voxels, double *min_hu, double *max_hu) {
+  if (format.bits_allocated != 8 && format.bits_allocated != 16)
+    throw std::invalid_argument("Unsupported bits allocated: " +
+                                std::to_string(format.bits_allocated));
+  rescaleToVoxels(stored, format, nb_pixels, win_min, win_max, voxels, min_hu,
+                  max_hu);
+}
+
+template <typename T>
+BasicVolumicData<T>::BasicVolumicData()
+    : width(-1), height(-1), depth(-1), pixel_width(-1), pixel_height(-1),
+      slice_spacing(0), win_min(0), win_max(0) {}
+
+template <typename T>
+BasicVolumicData<T>::BasicVolumicData(int W, int H, int D, double min,
+                                      double max)
+    : width(W), height(H), depth(D), pixel_width(-1), pixel_height(-1),
+      slice_spacing(0), win_min(min), win_max(max), ready_layers(D),
+      layers(D), layer_owners(D) {
+  // Each layer has its own buffer, so that it can be shared with copies of
+  // the volume and copied alone when written
+  for (int layer = 0; layer < D; layer++) {
+    std::shared_ptr<std::vector<T>> buffer =
+        std::make_shared<std::vector<T>>((size_t)W * H);
+    layers[layer] = buffer->data();
+    layer_owners[layer] = buffer;
+  }
+  size_t nb_blocks = (size_t)getNbBlocksX() * getNbBlocksY() * D;
+  block_min.resize(nb_blocks);
+  block_max.resize(nb_blocks);
+  layer_histograms.resize(D);
+  merged_layers.resize(D, false);
+}
 
-unsigned char VolumicData::getValue(int col, int row, int layer) {
-  return data[col + row * width + layer * width * height];
+template <typename T>
+BasicVolumicData<T>::BasicVolumicData(const BasicVolumicData &other)
+    : width(other.width), height(other.height), depth(other.depth),
+      pixel_width(other.pixel_width), pixel_height(other.pixel_height),
+      slice_spacing(other.slice_spacing), win_min(other.win_min),
+      win_max(other.win_max), ready_layers(other.ready_layers.size()),
+      layers(other.layers), layer_owners(other.layer_owners),
+      block_min(other.block_min), block_max(other.block_max),
+      layer_histograms(other.layer_histograms),
+      merged_layers(other.merged_layers.size(), false) {
+  for (size_t layer = 0; layer < ready_layers.size(); layer++)
+    ready_layers[layer] = other.ready_layers[layer].load();
 }
 
-QVector3D VolumicData::getCoordinate(int idx) {
+template <typename T> BasicVolumicData<T>::~BasicVolumicData() {}
+
+template <typename T>
+QVector3D BasicVolumicData<T>::getCoordinate(size_t idx) const {
   int x = idx % width;
-  int y = (idx/width) % height;
-  int z = idx / (width*height);
-  return QVector3D(x, y, z); 
+  int y = (idx / width) % height;
+  int z = idx / ((size_t)width * height);
+  return QVector3D(x, y, z);
+}
+
+template <typename T> T *BasicVolumicData<T>::getLayerData(int layer) {
+  if (layer < 0 || layer >= depth)
+    throw std::out_of_range(
+        "Layer " + std::to_string(layer) +
+        " is outside of volume (depth=" + std::to_string(depth) + ")");
+  detachLayer(layer);
+  return layers[layer];
 }
 
-void VolumicData::setLayer(uint16_t *layer_data, int layer) {
-  if (layer >= depth)
+template <typename T>
+const T *BasicVolumicData<T>::getLayerData(int layer) const {
+  if (layer < 0 || layer >= depth)
     throw std::out_of_range(
         "Layer " + std::to_string(layer) +
         " is outside of volume (depth=" + std::to_string(depth) + ")");
-  int offset = width * height * layer;
-  double offset_ = pow(2, 15) - intercept;
-  for (int i = 0; i < width * height; i++) {
-    data[i + offset] = layer_data[i] - offset_;
+  return layers[layer];
+}
+
+template <typename T>
+bool BasicVolumicData<T>::isLayerShared(int layer) const {
+  return layer_owners[layer].use_count() > 1;
+}
+
+template <typename T> void BasicVolumicData<T>::detachLayer(int layer) {
+  if (!isLayerShared(layer))
+    return;
+  std::shared_ptr<std::vector<T>> buffer = std::make_shared<std::vector<T>>(
+      layers[layer], layers[layer] + (size_t)width * height);
+  layers[layer] = buffer->data();
+  layer_owners[layer] = buffer;
+}
+
+template <typename T>
+void BasicVolumicData<T>::setLayer(const T *layer_data, int layer) {
+  std::copy(layer_data, layer_data + (size_t)width * height,
+            getLayerData(layer));
+  updateLayerSummary(layer);
+}
+
+template <typename T>
+void BasicVolumicData<T>::fillLayer(const void *stored,
+                                    const StoredPixelFormat &format,
+                                    int layer, double *min_hu,
+                                    double *max_hu) {
+  rescalePixels(stored, format, (size_t)width * height, win_min, win_max,
+                getLayerData(layer), min_hu, max_hu);
+  updateLayerSummary(layer);
+}
+
+template <typename T>
+void BasicVolumicData<T>::setExternalData(T *voxels,
+                                          std::shared_ptr<void> owner) {
+  // The volume may have been default constructed and resized by the caller
+  layers.resize(depth);
+  layer_owners.resize(depth);
+  // Each layer gets its own handle holding 'owner', so that it is only
+  // shared once the volume is copied
+  for (int layer = 0; layer < depth; layer++) {
+    layers[layer] = voxels + (size_t)width * height * layer;
+    layer_owners[layer] =
+        std::shared_ptr<void>(layers[layer], [owner](void *) {});
+  }
+  size_t nb_blocks = (size_t)getNbBlocksX() * getNbBlocksY() * depth;
+  block_min.resize(nb_blocks);
+  block_max.resize(nb_blocks);
+  layer_histograms.assign(depth, Histogram());
+  volume_histogram = Histogram();
+  merged_layers.assign(depth, false);
+  parallelFor(0, depth, [this](size_t layer) { updateLayerSummary(layer); });
+  for (std::atomic<bool> &ready : ready_layers)
+    ready = true;
+}
+
+template <typename T> size_t BasicVolumicData<T>::getNbVoxels() const {
+  return (size_t)width * height * depth;
+}
+
+template <typename T> void BasicVolumicData<T>::setLayerReady(int layer) {
+  ready_layers[layer].store(true, std::memory_order_release);
+}
+
+template <typename T>
+bool BasicVolumicData<T>::isLayerReady(int layer) const {
+  return ready_layers[layer].load(std::memory_order_acquire);
+}
+
+template <typename T> int BasicVolumicData<T>::getNbReadyLayers() const {
+  int nb_ready = 0;
+  for (const std::atomic<bool> &ready : ready_layers)
+    nb_ready += ready.load(std::memory_order_relaxed);
+  return nb_ready;
+}
+
+template <typename T> int BasicVolumicData<T>::getNbBlocksX() const {
+  return (width + block_size - 1) / block_size;
+}
+
+template <typename T> int BasicVolumicData<T>::getNbBlocksY() const {
+  return (height + block_size - 1) / block_size;
+}
+
+template <typename T>
+void BasicVolumicData<T>::getBlockRange(int block_x, int block_y, int layer,
+                                        double *min_hu,
+                                        double *max_hu) const {
+  size_t layer_offset = (size_t)getNbBlocksX() * getNbBlocksY() * layer;
+  size_t block_idx = layer_offset + block_x + (size_t)getNbBlocksX() * block_y;
+  *min_hu = VoxelTraits<T>::toHU(block_min[block_idx], win_min, win_max);
+  *max_hu = VoxelTraits<T>::toHU(block_max[block_idx], win_min, win_max);
+}
+
+template <typename T>
+Histogram BasicVolumicData<T>::getLayerHistogram(int layer) const {
+  std::lock_guard<std::mutex> lock(histogram_mutex);
+  return layer_histograms[layer];
+}
+
+template <typename T>
+Histogram BasicVolumicData<T>::getVolumeHistogram() const {
+  std::lock_guard<std::mutex> lock(histogram_mutex);
+  for (int layer = 0; layer < depth; layer++) {
+    if (!merged_layers[layer] && isLayerReady(layer)) {
+      volume_histogram.merge(layer_histograms[layer]);
+      merged_layers[layer] = true;
+    }
   }
+  return volume_histogram;
 }
 
-double VolumicData::manualWindowHandling(double value) {
+template <typename T>
+void BasicVolumicData<T>::updateLayerSummary(int layer) {
+  const int nb_blocks_x = getNbBlocksX();
+  const int nb_blocks_y = getNbBlocksY();
+  T *layer_min = block_min.data() + (size_t)nb_blocks_x * nb_blocks_y * layer;
+  T *layer_max = block_max.data() + (size_t)nb_blocks_x * nb_blocks_y * layer;
+  const T *voxels = layers[layer];
+  // Rows are read sequentially, each of them updating a row of blocks
+  for (int row = 0; row < height; row++) {
+    T *row_min = layer_min + (size_t)nb_blocks_x * (row / block_size);
+    T *row_max = layer_max + (size_t)nb_blocks_x * (row / block_size);
+    const T *line = voxels + (size_t)width * row;
+    for (int block_x = 0; block_x < nb_blocks_x; block_x++) {
+      const T *begin = line + block_x * block_size;
+      const T *end = line + std::min((block_x + 1) * block_size, width);
+      auto range = std::minmax_element(begin, end);
+      if (row % block_size == 0) {
+        row_min[block_x] = *range.first;
+        row_max[block_x] = *range.second;
+      } else {
+        row_min[block_x] = std::min(row_min[block_x], *range.first);
+        row_max[block_x] = std::max(row_max[block_x], *range.second);
+      }
+    }
+  }
+
+  // Counted before locking, layers are filled concurrently
+  Histogram histogram =
+      computeHistogram(voxels, (size_t)width * height, win_min, win_max);
+  std::lock_guard<std::mutex> lock(histogram_mutex);
+  if (merged_layers[layer]) {
+    volume_histogram.subtract(layer_histograms[layer]);
+    merged_layers[layer] = false;
+  }
+  layer_histograms[layer] = std::move(histogram);
+}
+
+template <typename T>
+double BasicVolumicData<T>::manualWindowHandling(double value, double win_min,
+                                                  double win_max) {
   if(value < win_min)  return 0;
   if(value > win_max)  return 1;
 
   return (value - win_min) / (win_max - win_min);
 }
 
-int VolumicData::threshold(double value, double min, double max, bool colorMode) {
-  
-  if (!colorMode) 
+template <typename T>
+int BasicVolumicData<T>::threshold(double value, double min, double max,
+                                   bool colorMode) {
+
+  if (!colorMode)
   {
     if(value <= max && value >= min)
       return 1;
   }
-  else 
+  else
   {
     if(range(value, 200, 1024))         return 2; // Bone
     else if(range(value, 100, 200))     return 3; // Structures faiblement calcifiées
@@ -67,7 +330,8 @@ int VolumicData::threshold(double value, double min, double max, bool colorMode)
   return 0;
 }
 
-QVector3D VolumicData::getColorSegment(int segment, double c) {
+template <typename T>
+QVector3D BasicVolumicData<T>::getColorSegment(int segment, double c) {
   QVector3D color;
   switch (segment)
   {
@@ -81,4 +345,18 @@ QVector3D VolumicData::getColorSegment(int segment, double c) {
     default: color = QVector3D(0, 0, 0); break;
   }
   return color;
-}
\ No newline at end of file
+}
+
+template class BasicVolumicData<int16_t>;
+template class BasicVolumicData<uint8_t>;
+template class BasicVolumicData<float>;
+
+template void rescalePixels<int16_t>(const void *, const StoredPixelFormat &,
+                                     size_t, double, double, int16_t *,
+                                     double *, double *);
+template void rescalePixels<uint8_t>(const void *, const StoredPixelFormat &,
+                                     size_t, double, double, uint8_t *,
+                                     double *, double *);
+template void rescalePixels<float>(const void *, const StoredPixelFormat &,
+                                   size_t, double, double, float *, double *,
+                                   double *);
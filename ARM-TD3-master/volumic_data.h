@@ -1,21 +1,87 @@
 #ifndef VOLUMIC_DATA_H
 #define VOLUMIC_DATA_H
 
+#include <atomic>
 #include <vector>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <iostream>
 #include <cmath>
 
 #include <QVector3D>
 
-class VolumicData {
+#include "histogram.h"
+
+/// How the pixel values of a slice are stored in its PixelData, along with
+/// the modality rescale converting them to Hounsfield units
+struct StoredPixelFormat {
+  /// 8 or 16
+  int bits_allocated;
+  /// Number of significant bits in each stored value
+  int bits_stored;
+  /// Are stored values two's complement?
+  bool is_signed;
+  double slope;
+  double intercept;
+};
+
+/// Conversion between Hounsfield units and the voxels of a volume
+/// - 'win_min' and 'win_max' are the window of the volume, only used by
+///   windowed voxel types
+template <typename T> struct VoxelTraits;
+
+/// Hounsfield units rounded to the nearest integer
+template <> struct VoxelTraits<int16_t> {
+  static inline int16_t fromHU(double hu, double, double) {
+    double rounded = std::round(hu);
+    if (rounded < INT16_MIN)
+      return INT16_MIN;
+    if (rounded > INT16_MAX)
+      return INT16_MAX;
+    return (int16_t)rounded;
+  }
+  static inline double toHU(int16_t value, double, double) { return value; }
+};
+
+/// The window of the volume mapped to [0,255], values outside of it are
+/// clamped
+template <> struct VoxelTraits<uint8_t> {
+  static inline uint8_t fromHU(double hu, double win_min, double win_max) {
+    if (hu <= win_min)
+      return 0;
+    if (hu >= win_max)
+      return 255;
+    return (uint8_t)std::lround((hu - win_min) / (win_max - win_min) * 255);
+  }
+  static inline double toHU(uint8_t value, double win_min, double win_max) {
+    return win_min + value * (win_max - win_min) / 255;
+  }
+};
+
+/// Exact Hounsfield units, for derived data
+template <> struct VoxelTraits<float> {
+  static inline float fromHU(double hu, double, double) { return hu; }
+  static inline double toHU(float value, double, double) { return value; }
+};
+
+/// Convert 'nb_pixels' values stored as described by 'format' to voxels of
+/// type T, reducing the min and max of the values in Hounsfield units
+template <typename T>
+void rescalePixels(const void *stored, const StoredPixelFormat &format,
+                   size_t nb_pixels, double win_min, double win_max,
+                   T *voxels, double *min_hu, double *max_hu);
+
+/// A volume whose voxels are of type T
+///
+/// The explicit instantiations are VolumicData (int16 Hounsfield units, used
+/// for decoded series), WindowedVolumicData and FloatVolumicData.
+template <typename T> class BasicVolumicData {
 public:
-  // The data from the volume stored:
-  // - column by column
-  // - line by line
-  // - slice by slice
-  std::vector<uint16_t> data;
+  typedef T Voxel;
+
+  /// Side of the square blocks of a layer summarized by their min and max
+  static const int block_size = 8;
 
   int width;
   int height;
@@ -25,24 +91,123 @@ public:
   double pixel_height;
   double slice_spacing;
 
+  /// The default window [HU]
   double win_min;
   double win_max;
-  double intercept;
+
+  /// One flag per layer telling if its content has been loaded
+  /// - Layers are filled by loading threads while the display reads them
+  std::vector<std::atomic<bool>> ready_layers;
 
   // The data provided
-  VolumicData();
-  VolumicData(int width, int height, int depth, double win_min, double win_max, double intercept);
-  VolumicData(const VolumicData &other);
-  ~VolumicData();
+  BasicVolumicData();
+  BasicVolumicData(int width, int height, int depth, double win_min,
+                   double win_max);
+  /// Share the voxels of 'other' without copying them, each layer is copied
+  /// the first time it is written in either volume
+  /// - 'other' must not be copied while some of its layers are being written
+  BasicVolumicData(const BasicVolumicData &other);
+  ~BasicVolumicData();
+
+  inline size_t getIndex(int col, int row, int layer) const {
+    return col + (size_t)width * (row + (size_t)height * layer);
+  }
+  inline T getValue(int col, int row, int layer) const {
+    return layers[layer][col + (size_t)width * row];
+  }
+
+  /// Value of the voxel at (col, row, layer) in Hounsfield units
+  inline double getHU(int col, int row, int layer) const {
+    return VoxelTraits<T>::toHU(getValue(col, row, layer), win_min, win_max);
+  }
+
+  /// Pointer to the first voxel of 'layer', so that it can be filled in
+  /// place. If the layer is shared with another volume, it is copied first.
+  T *getLayerData(int layer);
+  /// Pointer to the first voxel of 'layer', for reading only
+  const T *getLayerData(int layer) const;
+  /// Is 'layer' shared with another volume or with external data?
+  bool isLayerShared(int layer) const;
+
+  /// Copy voxels which are already of type T to 'layer'
+  void setLayer(const T *layer_data, int layer);
+
+  /// Fill 'layer' from the stored pixel values of a slice, applying the
+  /// modality rescale, and reduce the min and max of the slice [HU]
+  void fillLayer(const void *stored, const StoredPixelFormat &format,
+                 int layer, double *min_hu, double *max_hu);
+
+  /// Use the width*height*depth voxels at 'voxels' without copying them,
+  /// 'owner' keeps them alive until all the layers have been released. A
+  /// layer is written in place unless it is shared with a copy of the
+  /// volume, the caller must not write the voxels through another
+  /// reference. All the layers are flagged as ready.
+  void setExternalData(T *voxels, std::shared_ptr<void> owner);
 
-  unsigned char getValue(int col, int row, int layer);
+  /// Number of voxels in the volume
+  size_t getNbVoxels() const;
 
-  void setLayer(uint16_t *layer_data, int layer);
-  double manualWindowHandling(double value);
-  int threshold(double value, double min, double max, bool colorMode);
-  QVector3D getColorSegment(int segment, double c);
-  QVector3D getCoordinate(int idx);
+  /// Flag 'layer' as loaded, its content is not modified afterwards
+  void setLayerReady(int layer);
+  /// Is the content of 'layer' available?
+  bool isLayerReady(int layer) const;
+  /// Number of layers flagged as loaded
+  int getNbReadyLayers() const;
 
+  /// Number of blocks along x and y in each layer, border blocks being
+  /// smaller
+  int getNbBlocksX() const;
+  int getNbBlocksY() const;
+  /// Range of the values of a block of 'layer' [HU], only valid once the
+  /// layer has been filled
+  void getBlockRange(int block_x, int block_y, int layer, double *min_hu,
+                     double *max_hu) const;
+  /// Histogram of 'layer' [HU], empty until the layer has been filled
+  Histogram getLayerHistogram(int layer) const;
+  /// Histogram of all the ready layers [HU], only the layers which became
+  /// ready since the previous call are merged
+  Histogram getVolumeHistogram() const;
+
+  /// Recompute the block summary and the histogram of 'layer', needed after
+  /// writing to its voxels without using setLayer or fillLayer
+  void updateLayerSummary(int layer);
+
+  /// Position of 'value' in the window [win_min, win_max], in [0, 1]
+  static double manualWindowHandling(double value, double win_min,
+                                     double win_max);
+  static int threshold(double value, double min, double max, bool colorMode);
+  static QVector3D getColorSegment(int segment, double c);
+  QVector3D getCoordinate(size_t idx) const;
+
+private:
+  /// First voxel of each layer, the voxels being stored column by column then
+  /// line by line
+  std::vector<T *> layers;
+  /// Owner of the voxels of each layer
+  /// - Copies of the volume share the owners, a layer whose owner is shared
+  ///   is copied before being written
+  std::vector<std::shared_ptr<void>> layer_owners;
+
+  /// Give 'layer' its own copy of its voxels if they are shared
+  void detachLayer(int layer);
+
+  /// Min and max voxel of each block, x-fastest then y then layer
+  /// - Each layer is only updated by the thread filling it, before it is
+  ///   flagged as ready
+  std::vector<T> block_min;
+  std::vector<T> block_max;
+
+  /// Histogram of each layer, values being rounded to integer HU
+  std::vector<Histogram> layer_histograms;
+  /// Protects the histograms, which are read while other layers are filled
+  mutable std::mutex histogram_mutex;
+  /// Sum of the histograms of the layers flagged in merged_layers
+  mutable Histogram volume_histogram;
+  mutable std::vector<bool> merged_layers;
 };
 
+typedef BasicVolumicData<int16_t> VolumicData;
+typedef BasicVolumicData<uint8_t> WindowedVolumicData;
+typedef BasicVolumicData<float> FloatVolumicData;
+
 #endif // VOLUMIC_DATA_H
@@ -0,0 +1,36 @@
+#include "voxel_classifier.h"
+
+template <typename T>
+VoxelClassifier<T>::VoxelClassifier(double win_min, double win_max,
+                                    double threshold_min,
+                                    double threshold_max, bool color_mode,
+                                    bool hide_empty_points)
+    : win_min(win_min), win_max(win_max), threshold_min(threshold_min),
+      threshold_max(threshold_max), color_mode(color_mode),
+      hide_empty_points(hide_empty_points) {
+  if (!has_table)
+    return;
+  const size_t nb_values = (size_t)1 << (8 * sizeof(T));
+  flags.resize(nb_values);
+  colors.resize(nb_values);
+  for (size_t entry = 0; entry < nb_values; entry++) {
+    T value = (T)((int64_t)entry + (int64_t)std::numeric_limits<T>::min());
+    flags[entry] = classify(value, &colors[entry]);
+  }
+}
+
+template <typename T>
+uint8_t VoxelClassifier<T>::classify(T value, QVector3D *color) const {
+  typedef BasicVolumicData<T> Volume;
+  double hu = VoxelTraits<T>::toHU(value, win_min, win_max);
+  double c = Volume::manualWindowHandling(hu, win_min, win_max); // c [0;1]
+  int segment = Volume::threshold(hu, threshold_min, threshold_max, color_mode);
+  if (color != nullptr)
+    *color = Volume::getColorSegment(segment, c);
+  bool visible = segment != 0 && !(c <= 0 && hide_empty_points);
+  return segment | (visible ? visible_flag : 0);
+}
+
+template class VoxelClassifier<int16_t>;
+template class VoxelClassifier<uint8_t>;
+template class VoxelClassifier<float>;
@@ -0,0 +1,75 @@
+#ifndef VOXEL_CLASSIFIER_H
+#define VOXEL_CLASSIFIER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include <QVector3D>
+
+#include "volumic_data.h"
+
+/// Segment, visibility and color of the voxels of a volume for a given
+/// window and extraction mode
+///
+/// The classification only depends on the value of a voxel, so it is
+/// computed once for every possible value of 8 and 16-bit voxels and the
+/// extraction reads it from a table. Float voxels are classified on the fly.
+/// The results are the same as calling manualWindowHandling, threshold and
+/// getColorSegment on each voxel.
+template <typename T> class VoxelClassifier {
+public:
+  /// - 'win_min' and 'win_max' are the window of the classified volume [HU]
+  /// - Voxels with a value in [threshold_min, threshold_max] are in segment
+  ///   1, unless 'color_mode' segments them by tissue
+  /// - If 'hide_empty_points' is set, voxels below the window are hidden
+  VoxelClassifier(double win_min, double win_max, double threshold_min,
+                  double threshold_max, bool color_mode,
+                  bool hide_empty_points);
+
+  /// Segment of a voxel, 0 if it is not extracted
+  inline int getSegment(T value) const {
+    return has_table ? flags[getEntry(value)] & segment_mask
+                     : classify(value, nullptr) & segment_mask;
+  }
+  /// Is a voxel drawn, i.e. is it in a segment and not hidden as empty?
+  inline bool isVisible(T value) const {
+    return has_table ? flags[getEntry(value)] & visible_flag
+                     : classify(value, nullptr) & visible_flag;
+  }
+  inline QVector3D getColor(T value) const {
+    if (has_table)
+      return colors[getEntry(value)];
+    QVector3D color;
+    classify(value, &color);
+    return color;
+  }
+
+private:
+  /// Only 8 and 16-bit voxels have few enough values to be tabulated
+  static const bool has_table =
+      std::is_integral<T>::value && sizeof(T) <= 2;
+  enum : uint8_t { segment_mask = 0x07, visible_flag = 0x08 };
+
+  double win_min;
+  double win_max;
+  double threshold_min;
+  double threshold_max;
+  bool color_mode;
+  bool hide_empty_points;
+
+  /// Segment and visible flag of each value
+  std::vector<uint8_t> flags;
+  std::vector<QVector3D> colors;
+
+  static inline size_t getEntry(T value) {
+    return (size_t)((int64_t)value - (int64_t)std::numeric_limits<T>::min());
+  }
+  /// Segment and visible flag of 'value', its color is written to 'color'
+  /// if provided
+  uint8_t classify(T value, QVector3D *color) const;
+};
+
+#endif // VOXEL_CLASSIFIER_H